@@ -0,0 +1,364 @@
+#include "gpz++.hpp"
+#include <vif/core/main.hpp>
+#include <random>
+
+// Benchmark of GPz++ on synthetic catalogs
+// ----------------------------------------
+//
+// Usage: gpz++-bench [key=value ...]
+//
+// The synthetic catalogs contain galaxies with a uniform redshift distribution, and fluxes
+// following a simple redshift-dependent power law. Each band can be missing at random, and
+// fluxes are perturbed with Gaussian noise. The benchmark then measures the throughput of
+// each stage of GPz++ (parsing, transformation, training, prediction, writing the output)
+// for all combinations of the requested number of basis functions, covariance types, and
+// number of threads, as well as the latency of predicting objects one at a time (median and
+// 99th percentile, with the single-object predictor and with GPz::predict). The training
+// time is split into the time per iteration and a fixed setup time, from two fits with
+// max_iter and 2*max_iter iterations. Results are printed as a fixed-format table, to be
+// compared between versions and hardware.
+
+struct bench_options_t {
+    uint_t rows = 10000;
+    uint_t predict_rows = 10000;
+    uint_t bands = 5;
+    double missing = 0.05;
+    double error = 0.1;
+    uint_t seed = 42;
+    uint_t max_iter = 10;
+    vec1u  num_bf = {50, 100};
+    vec1s  covariance = {"gpvd"};
+    vec1u  n_thread = {1};
+    uint_t latency = 1000;
+    std::string work_dir = "";
+};
+
+bool generate_catalog(const std::string& filename, uint_t nrow, const bench_options_t& bopts,
+    uint_t seed) {
+
+    std::ofstream fout(filename);
+    if (!fout) {
+        error("could not open '", filename, "' for writing");
+        return false;
+    }
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uz(0.05, 3.0), u01(0.0, 1.0);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+
+    fout << "# id z_spec";
+    for (uint_t b : range(bopts.bands)) {
+        fout << " f_b" << b << " e_b" << b;
+    }
+    fout << "\n";
+
+    for (uint_t i : range(nrow)) {
+        double z = uz(rng);
+        fout << i << " " << z;
+
+        for (uint_t b : range(bopts.bands)) {
+            // Redshift dependent color, with fluxes of order unity
+            double lambda = (b + 1.0)/bopts.bands;
+            double flux = pow(lambda, 2.0*z - 1.0)*(1.0 + 0.2*sin(3.0*lambda*(1.0 + z)));
+            double err = bopts.error*(0.5 + u01(rng));
+
+            if (u01(rng) < bopts.missing) {
+                fout << " nan -1";
+            } else {
+                fout << " " << flux + err*gauss(rng) << " " << err;
+            }
+        }
+
+        fout << "\n";
+    }
+
+    return true;
+}
+
+bool parse_covariance(const std::string& name, PHZ_GPz::CovarianceType& cov) {
+    if      (name == "gpgl") cov = PHZ_GPz::CovarianceType::GLOBAL_LENGTH;
+    else if (name == "gpvl") cov = PHZ_GPz::CovarianceType::VARIABLE_LENGTH;
+    else if (name == "gpgd") cov = PHZ_GPz::CovarianceType::GLOBAL_DIAGONAL;
+    else if (name == "gpvd") cov = PHZ_GPz::CovarianceType::VARIABLE_DIAGONAL;
+    else if (name == "gpgc") cov = PHZ_GPz::CovarianceType::GLOBAL_COVARIANCE;
+    else if (name == "gpvc") cov = PHZ_GPz::CovarianceType::VARIABLE_COVARIANCE;
+    else return false;
+
+    return true;
+}
+
+template<typename T>
+bool parse_bench_list(const std::string& key, const std::string& val, vec<1,T>& out) {
+    vec1s spl = trim(split(val, ","));
+    out.resize(spl.size());
+    for (uint_t i : range(spl)) {
+        if (!from_string(spl[i], out[i])) {
+            error("could not parse value of argument ", key, " ('", val, "')");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template<typename T>
+bool parse_bench_value(const std::string& key, const std::string& val, T& out) {
+    if (!from_string(val, out)) {
+        error("could not parse value of argument ", key, " ('", val, "')");
+        return false;
+    }
+
+    return true;
+}
+
+bool read_bench_args(int argc, char* argv[], bench_options_t& bopts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eqp = arg.find_first_of('=');
+        if (eqp == arg.npos) {
+            error("ill formed argument '", arg, "', expected key=value");
+            return false;
+        }
+
+        std::string key = to_lower(trim(arg.substr(0, eqp)));
+        std::string val = trim(arg.substr(eqp+1));
+
+        bool ok = true;
+        if      (key == "rows")         ok = parse_bench_value(key, val, bopts.rows);
+        else if (key == "predict_rows") ok = parse_bench_value(key, val, bopts.predict_rows);
+        else if (key == "bands")        ok = parse_bench_value(key, val, bopts.bands);
+        else if (key == "missing")      ok = parse_bench_value(key, val, bopts.missing);
+        else if (key == "error")        ok = parse_bench_value(key, val, bopts.error);
+        else if (key == "seed")         ok = parse_bench_value(key, val, bopts.seed);
+        else if (key == "max_iter")     ok = parse_bench_value(key, val, bopts.max_iter);
+        else if (key == "num_bf")       ok = parse_bench_list(key, val, bopts.num_bf);
+        else if (key == "covariance")   bopts.covariance = trim(split(val, ","));
+        else if (key == "n_thread")     ok = parse_bench_list(key, val, bopts.n_thread);
+        else if (key == "latency")      ok = parse_bench_value(key, val, bopts.latency);
+        else if (key == "work_dir")     bopts.work_dir = val;
+        else {
+            error("unknown argument '", key, "'");
+            return false;
+        }
+
+        if (!ok) return false;
+    }
+
+    for (auto& c : bopts.covariance) {
+        PHZ_GPz::CovarianceType cov;
+        if (!parse_covariance(c, cov)) {
+            error("unknown covariance type '", c, "'");
+            return false;
+        }
+    }
+
+    if (bopts.bands == 0 || bopts.rows == 0 || bopts.predict_rows == 0 || bopts.max_iter == 0) {
+        error("ROWS, PREDICT_ROWS, BANDS and MAX_ITER must be strictly positive");
+        return false;
+    }
+
+    return true;
+}
+
+void print_row(const std::string& stage, const std::string& config, uint_t nrow, double time) {
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(4) << align_left(stage, 16) << align_left(config, 24)
+        << std::setw(10) << nrow << std::setw(14) << time << std::setw(14)
+        << std::setprecision(1) << (nrow > 0 && time > 0 ? nrow/time : 0.0);
+    std::cout << ss.str() << std::endl;
+}
+
+// Latencies are too short for the default precision
+void print_latency(const std::string& stage, const std::string& config, double time) {
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(7) << align_left(stage, 16) << align_left(config, 24)
+        << std::setw(10) << 1 << std::setw(14) << time << std::setw(14)
+        << std::setprecision(1) << (time > 0 ? 1.0/time : 0.0);
+    std::cout << ss.str() << std::endl;
+}
+
+double latency_percentile(vec1d t, double q) {
+    if (t.empty()) return dnan;
+
+    inplace_sort(t);
+    return t[uint_t(q*(t.size() - 1) + 0.5)];
+}
+
+int vif_main(int argc, char* argv[]) {
+    bench_options_t bopts;
+    if (!read_bench_args(argc, argv, bopts)) {
+        return 1;
+    }
+
+    std::string dir = bopts.work_dir;
+    if (!dir.empty() && dir.back() != '/') dir += '/';
+
+    options_t opts;
+    opts.training_catalog = dir+"gpz-bench-train.cat";
+    opts.prediction_catalog = dir+"gpz-bench-pred.cat";
+    opts.output_catalog = dir+"gpz-bench-out.cat";
+    opts.flux_column_prefix = "f_";
+    opts.error_column_prefix = "e_";
+    opts.bands_regex = {"^f_b[0-9]+$"};
+    opts.output_min = 0.0;
+    opts.verbose = false;
+
+    if (!generate_catalog(opts.training_catalog, bopts.rows, bopts, bopts.seed) ||
+        !generate_catalog(opts.prediction_catalog, bopts.predict_rows, bopts, bopts.seed+1)) {
+        return 1;
+    }
+
+    std::cout << "# GPz++ benchmark, version " << gpzpp_version << std::endl;
+    std::cout << "# rows=" << bopts.rows << " predict_rows=" << bopts.predict_rows
+        << " bands=" << bopts.bands << " missing=" << bopts.missing << " error=" << bopts.error
+        << " seed=" << bopts.seed << " max_iter=" << bopts.max_iter << std::endl;
+    std::cout << "#" << align_left("stage", 15) << align_left("config", 24)
+        << align_right("rows", 10) << align_right("time[s]", 14) << align_right("rows/s", 14)
+        << std::endl;
+
+    // Parsing and transformation
+    PHZ_GPz::Vec2d input, input_error;
+    PHZ_GPz::Vec1d output, weight;
+    opts.transform_inputs = "flux_to_luptitude";
+    if (!read_training(opts, input, input_error, output, weight)) {
+        return 1;
+    }
+
+    print_row("count", "training", bopts.rows, profile_last("read_training:count"));
+    print_row("parse", "training", bopts.rows, profile_last("read_training:parse"));
+    print_row("transform", "training", bopts.rows, profile_last("read_training:transform"));
+
+    id_column_t id;
+    PHZ_GPz::Vec2d pinput, pinput_error;
+    if (!read_prediction(opts, id, pinput, pinput_error)) {
+        return 1;
+    }
+
+    print_row("parse", "prediction", bopts.predict_rows, profile_last("read_prediction:parse"));
+
+    for (uint_t nbf : bopts.num_bf)
+    for (const std::string& cov : bopts.covariance)
+    for (uint_t nthread : bopts.n_thread) {
+        std::string config = "bf="+to_string(nbf)+" cov="+cov+" thr="+to_string(nthread);
+
+        PHZ_GPz::CovarianceType covtype;
+        parse_covariance(cov, covtype);
+
+        auto setup = [&](PHZ_GPz::GPz& g, uint_t niter) {
+            g.setVerboseMode(false);
+            g.setNumberOfBasisFunctions(nbf);
+            g.setCovarianceType(covtype);
+            g.setOptimizationMaxIterations(niter);
+            // Never stop early, so all configurations run the same number of iterations
+            g.setOptimizationTolerance(0.0);
+            g.setOptimizationGradientTolerance(0.0);
+
+            PHZ_GPz::GPzOptimizations optim;
+            optim.maxThreads = nthread;
+            optim.enableMultithreading = nthread > 1;
+            g.setOptimizationFlags(optim);
+        };
+
+        // The fit time includes a setup (normalization, initial basis functions, ...) which does
+        // not depend on the number of iterations. Fit twice, with MAX_ITER and twice as many
+        // iterations: the difference is the time of MAX_ITER iterations alone.
+        PHZ_GPz::GPz gpz_short, gpz;
+        setup(gpz_short, bopts.max_iter);
+        setup(gpz, 2*bopts.max_iter);
+
+        double tfit[2];
+        double t0;
+        try {
+            t0 = now();
+            gpz_short.fit(input, input_error, output, weight);
+            tfit[0] = now() - t0;
+
+            t0 = now();
+            gpz.fit(input, input_error, output, weight);
+            tfit[1] = now() - t0;
+        } catch (std::exception& e) {
+            error("an exception occured during the training (", config, ")");
+            error(e.what());
+            return 1;
+        }
+
+        const double titer = std::max(tfit[1] - tfit[0], 0.0)/bopts.max_iter;
+        print_row("fit/iter", config, bopts.rows, titer);
+        print_row("fit/setup", config, bopts.rows, std::max(tfit[0] - bopts.max_iter*titer, 0.0));
+
+        PHZ_GPz::GPzOutput out;
+        prediction_context_t ctx;
+        t0 = now();
+        try {
+            make_predictions(opts, gpz, pinput, pinput_error, out, ctx);
+        } catch (std::exception& e) {
+            error("an exception occured while making predictions (", config, ")");
+            error(e.what());
+            return 1;
+        }
+
+        print_row("predict", config, bopts.predict_rows, now() - t0);
+        ctx.report(opts);
+
+        t0 = now();
+        write_output(opts, gpz, id, out);
+        print_row("write", config, bopts.predict_rows, now() - t0);
+
+        if (bopts.latency > 0) {
+            // Objects predicted one at a time, without and with input uncertainties
+            const uint_t nobj = std::min(bopts.latency, bopts.predict_rows);
+            const uint_t nfeat = pinput.cols();
+            const bool has_error = pinput_error.size() != 0;
+
+            single_predictor_t single(opts, gpz);
+            single_predictor_t::result_t res;
+            std::vector<double> flux(nfeat), err(nfeat);
+            PHZ_GPz::Vec2d row(1, nfeat), row_error(1, nfeat);
+            vec1d tsingle(nobj), tgpz(nobj);
+
+            auto measure = [&](bool with_error, const std::string& suffix) {
+                double max_diff = 0.0;
+                uint_t ndirect = 0;
+                for (uint_t i : range(nobj)) {
+                    for (uint_t k : range(nfeat)) {
+                        flux[k] = row(0,k) = pinput(i,k);
+                        if (with_error) err[k] = row_error(0,k) = pinput_error(i,k);
+                    }
+
+                    const double* perr = (with_error ? err.data() : nullptr);
+                    if (single.direct(flux.data(), perr)) ++ndirect;
+
+                    t0 = now();
+                    single.predict_one(flux.data(), perr, res);
+                    tsingle[i] = now() - t0;
+
+                    t0 = now();
+                    PHZ_GPz::GPzOutput ref = gpz.predict(row,
+                        with_error ? row_error : PHZ_GPz::Vec2d());
+                    tgpz[i] = now() - t0;
+
+                    max_diff = std::max(max_diff, std::abs(res.value - ref.value[0]));
+                }
+
+                print_latency("single"+suffix+"/p50", config, latency_percentile(tsingle, 0.50));
+                print_latency("single"+suffix+"/p99", config, latency_percentile(tsingle, 0.99));
+                print_latency("gpz_one"+suffix+"/p50", config, latency_percentile(tgpz, 0.50));
+                print_latency("gpz_one"+suffix+"/p99", config, latency_percentile(tgpz, 0.99));
+                std::cout << "# single-object predictor" << suffix << " (" << config
+                    << "): direct=" << ndirect << "/" << nobj << " max|d(value)|=" << max_diff
+                    << std::endl;
+            };
+
+            std::cout << "# single-object predictor (" << config << "): fast=" << single.fast
+                << " noisy=" << single.fast_noisy << " missing=" << single.fast_missing
+                << std::endl;
+
+            measure(false, "");
+            if (has_error) {
+                measure(true, "+err");
+            }
+        }
+    }
+
+    return 0;
+}
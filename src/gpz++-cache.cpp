@@ -0,0 +1,108 @@
+#include "gpz++.hpp"
+
+// Content-addressed model cache
+// -----------------------------
+//
+// Trained models are stored in MODEL_CACHE_DIR under a name derived from a hash of everything
+// that determines the outcome of the training: the training arrays (see training_data_key()),
+// the output the model is trained for, the resolved values of the GPz options, and the starting
+// model (if USE_MODEL_AS_HINT=1). A cached model is reused if and only if all of these are
+// identical. Options that GPz can report are hashed by value after parsing, so an option set to
+// its default value is the same as an option left out. The others are hashed as "unset" when
+// left out, since their value is then the default of the GPz library, which GPz++ cannot know.
+// The specialist models (see SPECIALIST_MODELS) are listed in a file of the cache named after
+// the same hash, for all the outputs, and the options of the specialists.
+
+namespace cache_impl {
+    template<typename T>
+    void hash_gpz_option(std::ostream& ss, const options_t& opts, const std::string& name,
+        const T& value) {
+
+        if (opts.gpz_option_set(name)) {
+            ss << value << '\n';
+        } else {
+            ss << "unset\n";
+        }
+    }
+}
+
+std::uint64_t training_data_key(const options_t& opts) {
+    std::uint64_t h = hash_seed;
+    h = hash_string(gpzpp_version, h);
+    h = file_signature(opts.training_catalog, h);
+
+    // All the outputs: rows are kept if any output is valid, and sampled on the first output
+    vec1s outputs = opts.output_columns;
+    if (outputs.empty()) {
+        outputs.push_back(opts.output_column);
+    }
+
+    std::ostringstream ss;
+    ss << std::setprecision(17);
+    for (uint_t i : range(outputs)) {
+        options_t o = output_options(opts, i);
+        ss << outputs[i] << ' ' << o.output_min << ' ' << o.output_max << '\n';
+    }
+
+    ss << opts.weight_column << '\n' << opts.flux_column_prefix << '\n'
+        << opts.error_column_prefix << '\n' << opts.use_errors << '\n'
+        << collapse(opts.bands_regex, "\n") << '\n' << opts.transform_inputs << '\n'
+        << opts.train_max_rows << ' ' << opts.train_max_rows_per_bin << ' '
+        << opts.train_sample_seed << ' ' << opts.balanced_weighting_bin << '\n';
+
+    for (double f0 : opts.luptitude_f0) {
+        ss << ' ' << f0;
+    }
+
+    return hash_string(ss.str(), h);
+}
+
+std::string model_cache_file(const options_t& opts, const PHZ_GPz::GPzModel& hint) {
+    std::uint64_t h = training_data_key(opts);
+
+    // GPz options that have an impact on the trained model
+    std::ostringstream ss;
+    ss << std::setprecision(17)
+        << opts.output_column << '\n'
+        << opts.num_bf << ' ' << int(opts.covariance) << ' ' << int(opts.prior_mean) << ' '
+        << int(opts.weighting_scheme) << ' ' << int(opts.normalization_scheme) << ' '
+        << int(opts.output_error_type) << '\n';
+
+    using cache_impl::hash_gpz_option;
+    hash_gpz_option(ss, opts, "balanced_weighting_bin",        opts.balanced_weighting_bin);
+    hash_gpz_option(ss, opts, "balanced_weighting_max_weight", opts.balanced_weighting_max_weight);
+    hash_gpz_option(ss, opts, "bf_position_seed",              opts.bf_position_seed);
+    hash_gpz_option(ss, opts, "fuzzing",                       opts.fuzzing);
+    hash_gpz_option(ss, opts, "fuzzing_seed",                  opts.fuzzing_seed);
+    hash_gpz_option(ss, opts, "max_iter",                      opts.max_iter);
+    hash_gpz_option(ss, opts, "tolerance",                     opts.tolerance);
+    hash_gpz_option(ss, opts, "grad_tolerance",                opts.grad_tolerance);
+    hash_gpz_option(ss, opts, "train_valid_ratio",             opts.train_valid_ratio);
+    hash_gpz_option(ss, opts, "valid_sample_seed",             opts.valid_sample_seed);
+    hash_gpz_option(ss, opts, "valid_sample_method",           int(opts.valid_sample_method));
+
+    h = hash_string(ss.str(), h);
+
+    if (opts.use_model_as_hint && hint.modelWeights.size() != 0) {
+        h = hash_model(hint, h);
+    }
+
+    return file::directorize(opts.model_cache_dir)+"gpz_model_"+hash_hex(h)+".dat";
+}
+
+std::string specialist_cache_file(const options_t& opts) {
+    // Specialists are trained on the same arrays and with the same GPz options as the global
+    // models (but without starting model), and with the SPECIALIST_* options
+    std::uint64_t h = hash_seed;
+    const uint_t nout = std::max(opts.output_columns.size(), uint_t(1));
+    for (uint_t i : range(nout)) {
+        h = hash_string(model_cache_file(output_options(opts, i), PHZ_GPz::GPzModel()), h);
+    }
+
+    std::ostringstream ss;
+    ss << opts.specialist_min_rows << ' ' << opts.specialist_num_bf << '\n';
+
+    h = hash_string(ss.str(), h);
+
+    return file::directorize(opts.model_cache_dir)+"gpz_specialists_"+hash_hex(h)+".txt";
+}
@@ -0,0 +1,550 @@
+#include "gpz++.hpp"
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef GPZPP_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef GPZPP_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+// Compressed catalogs
+// -------------------
+//
+// Input catalogs compressed with gzip or zstd are recognized from their first bytes, whatever
+// their name. They are read by a single background thread, which decompresses them chunk by
+// chunk into a small queue while the main thread parses the lines, so that reading,
+// decompressing, and parsing overlap; the decompression itself is sequential, since a gzip or
+// zstd stream cannot be split between threads. Files made of several concatenated gzip members
+// or zstd frames are supported. read_ascii() does not count the rows of a compressed catalog
+// beforehand, so that it is only decompressed once.
+//
+// The output catalog can be compressed on the fly (OUTPUT_COMPRESSION). Each block of rows (see
+// PREDICTION_BLOCK_SIZE) is written as a separate gzip member or zstd frame, so an interrupted
+// output can be truncated at a block boundary and appended to when resuming.
+
+namespace compress_impl {
+    const std::size_t chunk_size = 1 << 20;
+    const uint_t queue_depth = 4;
+
+    // Decompression
+    struct decoder_t {
+        virtual ~decoder_t() = default;
+        // Decompress 'n' bytes from 'in' and append the result to 'out'
+        virtual bool decode(const char* in, std::size_t n, std::string& out, std::string& err) = 0;
+        // Check that the stream was complete
+        virtual bool finish(std::string& err) = 0;
+    };
+
+#ifdef GPZPP_WITH_ZLIB
+    struct gzip_decoder_t : decoder_t {
+        z_stream z;
+        std::vector<char> buf = std::vector<char>(chunk_size);
+        bool in_member = false;
+
+        gzip_decoder_t() {
+            std::memset(&z, 0, sizeof(z));
+            inflateInit2(&z, 15 + 32); // automatic gzip header detection
+        }
+
+        ~gzip_decoder_t() {
+            inflateEnd(&z);
+        }
+
+        bool decode(const char* in, std::size_t n, std::string& out, std::string& err) override {
+            z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+            z.avail_in = n;
+
+            do {
+                z.next_out = reinterpret_cast<Bytef*>(buf.data());
+                z.avail_out = buf.size();
+
+                int ret = inflate(&z, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    err = (z.msg ? z.msg : "corrupted gzip stream");
+                    return false;
+                }
+
+                out.append(buf.data(), buf.size() - z.avail_out);
+
+                if (ret == Z_STREAM_END) {
+                    // Another member may follow
+                    inflateReset(&z);
+                    in_member = false;
+                } else if (ret == Z_OK) {
+                    in_member = true;
+                }
+            } while (z.avail_in > 0 || z.avail_out == 0);
+
+            return true;
+        }
+
+        bool finish(std::string& err) override {
+            if (in_member) {
+                err = "truncated gzip stream";
+                return false;
+            }
+
+            return true;
+        }
+    };
+#endif
+
+#ifdef GPZPP_WITH_ZSTD
+    struct zstd_decoder_t : decoder_t {
+        ZSTD_DCtx* ctx = ZSTD_createDCtx();
+        std::vector<char> buf = std::vector<char>(chunk_size);
+        bool in_frame = false;
+
+        ~zstd_decoder_t() {
+            ZSTD_freeDCtx(ctx);
+        }
+
+        bool decode(const char* in, std::size_t n, std::string& out, std::string& err) override {
+            ZSTD_inBuffer zin = {in, n, 0};
+            while (true) {
+                ZSTD_outBuffer zout = {buf.data(), buf.size(), 0};
+                std::size_t ret = ZSTD_decompressStream(ctx, &zout, &zin);
+                if (ZSTD_isError(ret)) {
+                    err = ZSTD_getErrorName(ret);
+                    return false;
+                }
+
+                out.append(buf.data(), zout.pos);
+                in_frame = ret != 0;
+
+                if (zin.pos == zin.size && zout.pos < zout.size) break;
+            }
+
+            return true;
+        }
+
+        bool finish(std::string& err) override {
+            if (in_frame) {
+                err = "truncated zstd stream";
+                return false;
+            }
+
+            return true;
+        }
+    };
+#endif
+
+    std::unique_ptr<decoder_t> make_decoder(compression_t c) {
+        switch (c) {
+#ifdef GPZPP_WITH_ZLIB
+            case compression_t::gzip: return std::unique_ptr<decoder_t>(new gzip_decoder_t());
+#endif
+#ifdef GPZPP_WITH_ZSTD
+            case compression_t::zstd: return std::unique_ptr<decoder_t>(new zstd_decoder_t());
+#endif
+            default: return nullptr;
+        }
+    }
+
+    // Stream buffer fed by a background decompression thread
+    class decode_buf_t : public std::streambuf {
+        std::ifstream file;
+        std::unique_ptr<decoder_t> decoder;
+        std::thread worker;
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<std::string> queue;
+        bool finished = false;
+        bool stop = false;
+
+        std::string current;
+
+        void run() {
+            std::vector<char> in(chunk_size);
+            std::string out;
+            std::string err;
+            bool ok = file.is_open();
+            if (!ok) err = "could not open file";
+
+            while (ok && file) {
+                file.read(in.data(), in.size());
+                std::size_t n = file.gcount();
+                if (n == 0) break;
+
+                ok = decoder->decode(in.data(), n, out, err);
+                if (out.size() >= chunk_size || (!file && !out.empty())) {
+                    if (!push(out)) return;
+                }
+            }
+
+            if (ok && !out.empty() && !push(out)) return;
+
+            if (ok) {
+                if (file.bad()) {
+                    ok = false;
+                    err = "read error";
+                } else {
+                    ok = decoder->finish(err);
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) message = err;
+            finished = true;
+            cond.notify_all();
+        }
+
+        bool push(std::string& out) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&]() { return queue.size() < queue_depth || stop; });
+            if (stop) return false;
+
+            queue.push_back(std::move(out));
+            out.clear();
+            cond.notify_all();
+            return true;
+        }
+
+    protected:
+        int_type underflow() override {
+            if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return !queue.empty() || finished; });
+                if (queue.empty()) return traits_type::eof();
+
+                current = std::move(queue.front());
+                queue.pop_front();
+                cond.notify_all();
+            }
+
+            setg(&current[0], &current[0], &current[0] + current.size());
+            return traits_type::to_int_type(*gptr());
+        }
+
+    public:
+        std::string message;
+
+        decode_buf_t(const std::string& filename, compression_t c) :
+            file(filename, std::ios::binary), decoder(make_decoder(c)) {
+            worker = std::thread([this]() { run(); });
+        }
+
+        ~decode_buf_t() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+                cond.notify_all();
+            }
+
+            worker.join();
+        }
+
+        bool failed() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return !message.empty();
+        }
+    };
+
+    // Compression
+    struct encoder_t {
+        virtual ~encoder_t() = default;
+        // Compress 'n' bytes from 'in' and append the result to 'out', optionally ending the frame
+        virtual bool encode(const char* in, std::size_t n, bool end, std::string& out) = 0;
+    };
+
+    struct copy_encoder_t : encoder_t {
+        bool encode(const char* in, std::size_t n, bool, std::string& out) override {
+            out.append(in, n);
+            return true;
+        }
+    };
+
+#ifdef GPZPP_WITH_ZLIB
+    struct gzip_encoder_t : encoder_t {
+        z_stream z;
+        std::vector<char> buf = std::vector<char>(chunk_size);
+        bool in_member = false;
+
+        gzip_encoder_t() {
+            std::memset(&z, 0, sizeof(z));
+            deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        }
+
+        ~gzip_encoder_t() {
+            deflateEnd(&z);
+        }
+
+        bool encode(const char* in, std::size_t n, bool end, std::string& out) override {
+            if (n == 0 && !(end && in_member)) return true;
+
+            in_member = true;
+            z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+            z.avail_in = n;
+
+            int ret;
+            do {
+                z.next_out = reinterpret_cast<Bytef*>(buf.data());
+                z.avail_out = buf.size();
+
+                ret = deflate(&z, end ? Z_FINISH : Z_NO_FLUSH);
+                if (ret == Z_STREAM_ERROR) return false;
+
+                out.append(buf.data(), buf.size() - z.avail_out);
+            } while (z.avail_out == 0 || (end && ret != Z_STREAM_END));
+
+            if (end) {
+                deflateReset(&z);
+                in_member = false;
+            }
+
+            return true;
+        }
+    };
+#endif
+
+#ifdef GPZPP_WITH_ZSTD
+    struct zstd_encoder_t : encoder_t {
+        ZSTD_CCtx* ctx = ZSTD_createCCtx();
+        std::vector<char> buf = std::vector<char>(chunk_size);
+        bool in_frame = false;
+
+        ~zstd_encoder_t() {
+            ZSTD_freeCCtx(ctx);
+        }
+
+        bool encode(const char* in, std::size_t n, bool end, std::string& out) override {
+            if (n == 0 && !(end && in_frame)) return true;
+
+            in_frame = true;
+            ZSTD_inBuffer zin = {in, n, 0};
+            std::size_t ret;
+            do {
+                ZSTD_outBuffer zout = {buf.data(), buf.size(), 0};
+                ret = ZSTD_compressStream2(ctx, &zout, &zin, end ? ZSTD_e_end : ZSTD_e_continue);
+                if (ZSTD_isError(ret)) return false;
+
+                out.append(buf.data(), zout.pos);
+            } while (end ? ret != 0 : zin.pos < zin.size);
+
+            if (end) {
+                in_frame = false;
+            }
+
+            return true;
+        }
+    };
+#endif
+
+    std::unique_ptr<encoder_t> make_encoder(compression_t c) {
+        switch (c) {
+#ifdef GPZPP_WITH_ZLIB
+            case compression_t::gzip: return std::unique_ptr<encoder_t>(new gzip_encoder_t());
+#endif
+#ifdef GPZPP_WITH_ZSTD
+            case compression_t::zstd: return std::unique_ptr<encoder_t>(new zstd_encoder_t());
+#endif
+            default: return std::unique_ptr<encoder_t>(new copy_encoder_t());
+        }
+    }
+
+    // Stream buffer compressing into a file
+    class encode_buf_t : public std::streambuf {
+        std::ofstream file;
+        std::unique_ptr<encoder_t> encoder;
+        std::vector<char> buf = std::vector<char>(chunk_size);
+        std::string out;
+        bool ok = true;
+
+    protected:
+        int_type overflow(int_type c) override {
+            if (!write(false)) return traits_type::eof();
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+
+            return traits_type::not_eof(c);
+        }
+
+        int sync() override {
+            return write(false) ? 0 : -1;
+        }
+
+    public:
+        std::uint64_t size = 0;
+
+        encode_buf_t(const std::string& filename, compression_t c, bool append) :
+            file(filename, std::ios::binary | (append ? std::ios::app : std::ios::trunc)),
+            encoder(make_encoder(c)) {
+
+            if (append) {
+                std::ifstream in(filename, std::ios::binary | std::ios::ate);
+                size = in.tellg();
+            }
+
+            setp(buf.data(), buf.data() + buf.size());
+        }
+
+        bool is_open() const {
+            return file.is_open();
+        }
+
+        bool write(bool end) {
+            ok = ok && encoder->encode(pbase(), pptr() - pbase(), end, out);
+            setp(buf.data(), buf.data() + buf.size());
+
+            if (ok && !out.empty()) {
+                file.write(out.data(), out.size());
+                size += out.size();
+                out.clear();
+            }
+
+            if (end) file.flush();
+
+            ok = ok && file;
+            return ok;
+        }
+    };
+}
+
+bool parse_compression(const std::string& name, compression_t& c) {
+    std::string n = to_lower(trim(name));
+    if (n.empty() || n == "none" || n == "no") {
+        c = compression_t::none;
+    } else if (n == "gzip" || n == "gz") {
+        c = compression_t::gzip;
+    } else if (n == "zstd" || n == "zst") {
+        c = compression_t::zstd;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+std::string compression_name(compression_t c) {
+    switch (c) {
+        case compression_t::gzip: return "gzip";
+        case compression_t::zstd: return "zstd";
+        default: return "none";
+    }
+}
+
+bool compression_supported(compression_t c) {
+    switch (c) {
+#ifdef GPZPP_WITH_ZLIB
+        case compression_t::gzip: return true;
+#endif
+#ifdef GPZPP_WITH_ZSTD
+        case compression_t::zstd: return true;
+#endif
+        case compression_t::none: return true;
+        default: return false;
+    }
+}
+
+compression_t detect_compression(const std::string& filename) {
+    unsigned char magic[4] = {0, 0, 0, 0};
+    std::ifstream in(filename, std::ios::binary);
+    in.read(reinterpret_cast<char*>(magic), 4);
+
+    if (in.gcount() >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return compression_t::gzip;
+    } else if (in.gcount() == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+        magic[2] == 0x2f && magic[3] == 0xfd) {
+        return compression_t::zstd;
+    } else {
+        return compression_t::none;
+    }
+}
+
+input_file_t::input_file_t(const std::string& filename) : std::istream(nullptr), filename(filename) {
+    compression = detect_compression(filename);
+    if (compression == compression_t::none) {
+        std::unique_ptr<std::filebuf> fbuf(new std::filebuf());
+        if (fbuf->open(filename, std::ios::in | std::ios::binary)) {
+            buffer = std::move(fbuf);
+        }
+    } else if (compression_supported(compression) && file::exists(filename)) {
+        buffer.reset(new compress_impl::decode_buf_t(filename, compression));
+    }
+
+    if (buffer) {
+        rdbuf(buffer.get());
+    } else {
+        setstate(std::ios::failbit);
+    }
+}
+
+input_file_t::~input_file_t() {
+    rdbuf(nullptr);
+}
+
+bool input_file_t::is_open() const {
+    return buffer != nullptr;
+}
+
+bool input_file_t::compressed() const {
+    return compression != compression_t::none;
+}
+
+bool input_file_t::check() const {
+    if (!buffer) {
+        if (!compression_supported(compression)) {
+            error("'", filename, "' is compressed with ", compression_name(compression),
+                " but this build of GPz++ does not support it");
+        } else {
+            error("could not open '", filename, "'");
+        }
+
+        return false;
+    }
+
+    if (compressed()) {
+        auto* dbuf = static_cast<compress_impl::decode_buf_t*>(buffer.get());
+        if (dbuf->failed()) {
+            error("could not decompress '", filename, "': ", dbuf->message);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+output_file_t::output_file_t(const std::string& filename, compression_t compression, bool append) :
+    std::ostream(nullptr) {
+
+    std::unique_ptr<compress_impl::encode_buf_t> ebuf(
+        new compress_impl::encode_buf_t(filename, compression, append));
+
+    if (ebuf->is_open()) {
+        buffer = std::move(ebuf);
+        rdbuf(buffer.get());
+    } else {
+        setstate(std::ios::failbit);
+    }
+}
+
+output_file_t::~output_file_t() {
+    end_block();
+    rdbuf(nullptr);
+}
+
+bool output_file_t::end_block() {
+    if (!buffer) return false;
+
+    if (!static_cast<compress_impl::encode_buf_t*>(buffer.get())->write(true)) {
+        setstate(std::ios::badbit);
+        return false;
+    }
+
+    return true;
+}
+
+std::uint64_t output_file_t::size() const {
+    return buffer ? static_cast<compress_impl::encode_buf_t*>(buffer.get())->size : 0;
+}
@@ -0,0 +1,251 @@
+#include "gpz++.hpp"
+#include <map>
+
+// Evaluation of predictions on labelled data
+// ------------------------------------------
+//
+// The catalog is read and predicted in blocks of rows, and the metrics are accumulated on the
+// fly (evaluation_t) without storing the catalog or the predictions. With
+// dz = (value - truth)/(1 + truth), or dz = value - truth if EVALUATE_RELATIVE=0 for this output
+// (e.g., for an output that is not a redshift), the metrics are:
+//  - the mean and median of dz (bias), and its RMS,
+//  - the normalized median absolute deviation, NMAD = 1.4826*median(|dz - median(dz)|),
+//  - the fraction of outliers with |dz| > EVALUATE_OUTLIER,
+//  - the histogram of the probability integral transform, PIT = Phi((truth - value)/uncertainty),
+//    which should be flat if the uncertainties are correct,
+//  - the fraction of objects with |truth - value| < k*uncertainty (coverage), for k = 1, 2, 3.
+// The median and NMAD are computed from a histogram of dz with a resolution of 1e-4, which is
+// accurate enough for all practical purposes.
+
+namespace evaluate_impl {
+    const uint_t npit = 20;
+    const double dz_step = 1e-4;
+    const double dz_max = 0.5;
+
+    struct dz_histogram_t {
+        std::vector<std::uint32_t> counts;
+        std::uint64_t n = 0, under = 0, over = 0;
+
+        dz_histogram_t() : counts(2*dz_max/dz_step + 0.5, 0) {}
+
+        void add(double dz) {
+            ++n;
+            double x = (dz + dz_max)/dz_step;
+            if (x < 0.0) {
+                ++under;
+            } else if (x >= counts.size()) {
+                ++over;
+            } else {
+                ++counts[uint_t(x)];
+            }
+        }
+
+        // Fraction of values below 'v'
+        double cdf(double v) const {
+            double x = (v + dz_max)/dz_step;
+            if (x <= 0.0) return double(under)/n;
+            if (x >= counts.size()) return double(n - over)/n;
+
+            uint_t b = x;
+            std::uint64_t c = under;
+            for (uint_t i : range(b)) c += counts[i];
+            return (c + (x - b)*counts[b])/n;
+        }
+
+        double quantile(double q) const {
+            double target = q*n;
+            double c = under;
+            if (target <= c) return -dz_max;
+
+            for (uint_t i : range(counts.size())) {
+                if (c + counts[i] >= target) {
+                    return -dz_max + (i + (target - c)/counts[i])*dz_step;
+                }
+
+                c += counts[i];
+            }
+
+            return dz_max;
+        }
+
+        double nmad() const {
+            if (n == 0) return dnan;
+
+            // Find the median absolute deviation by bisection on the folded distribution
+            double med = quantile(0.5);
+            double lo = 0.0, hi = 2.0*dz_max;
+            for (uint_t iter = 0; iter < 60 && hi - lo > 0.01*dz_step; ++iter) {
+                double mid = 0.5*(lo + hi);
+                if (cdf(med + mid) - cdf(med - mid) < 0.5) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            return 1.4826*0.5*(lo + hi);
+        }
+    };
+
+    struct metrics_t {
+        std::uint64_t n = 0, noutlier = 0, nunc = 0;
+        double sum_dz = 0.0, sum_dz2 = 0.0;
+        std::uint64_t ncover[3] = {0, 0, 0};
+        std::vector<std::uint64_t> pit = std::vector<std::uint64_t>(npit, 0);
+        dz_histogram_t hist;
+
+        void add(double truth, double value, double uncertainty, const options_t& opts) {
+            double dz = value - truth;
+            if (opts.evaluate_relative) dz /= 1.0 + truth;
+
+            ++n;
+            sum_dz += dz;
+            sum_dz2 += dz*dz;
+            if (std::abs(dz) > opts.evaluate_outlier) ++noutlier;
+            hist.add(dz);
+
+            if (uncertainty > 0.0 && is_finite(uncertainty)) {
+                ++nunc;
+                double t = (truth - value)/uncertainty;
+                double p = 0.5*std::erfc(-t/sqrt(2.0));
+                ++pit[std::min(uint_t(p*npit), npit-1)];
+                for (uint_t k : range(3)) {
+                    if (std::abs(t) < k+1) ++ncover[k];
+                }
+            }
+        }
+
+        double coverage(uint_t k) const {
+            return nunc > 0 ? double(ncover[k])/nunc : dnan;
+        }
+    };
+
+    void write_metrics(std::ofstream& fout, const metrics_t& m) {
+        double mean = (m.n > 0 ? m.sum_dz/m.n : dnan);
+        fout << "n_objects        = " << m.n << "\n";
+        fout << "bias_mean        = " << mean << "\n";
+        fout << "bias_median      = " << (m.n > 0 ? m.hist.quantile(0.5) : dnan) << "\n";
+        fout << "rms              = " << (m.n > 0 ? sqrt(m.sum_dz2/m.n) : dnan) << "\n";
+        fout << "nmad             = " << m.hist.nmad() << "\n";
+        fout << "outlier_fraction = " << (m.n > 0 ? double(m.noutlier)/m.n : dnan) << "\n";
+        fout << "coverage_1sigma  = " << m.coverage(0) << "  # expected 0.6827\n";
+        fout << "coverage_2sigma  = " << m.coverage(1) << "  # expected 0.9545\n";
+        fout << "coverage_3sigma  = " << m.coverage(2) << "  # expected 0.9973\n";
+    }
+}
+
+struct evaluation_t::state_t {
+    evaluate_impl::metrics_t total;
+    std::map<std::int64_t, evaluate_impl::metrics_t> bins;
+    prediction_context_t ctx;
+};
+
+evaluation_t::evaluation_t() : state(new state_t) {}
+evaluation_t::evaluation_t(evaluation_t&&) noexcept = default;
+evaluation_t::~evaluation_t() = default;
+
+uint_t evaluation_block_size(const options_t& opts) {
+    return (opts.prediction_block_size > 0 ? opts.prediction_block_size : 10000);
+}
+
+void evaluation_t::add(const options_t& opts, PHZ_GPz::GPz& gpz, specialist_set_t& spec,
+    uint_t iout, const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec1d& output) {
+
+    // The metrics only need the value and its uncertainty, regardless of OUTPUT_COLUMNS
+    options_t eopts = opts;
+    eopts.quantities = output_quantities_t();
+    eopts.quantities.var_density = false;
+    eopts.quantities.var_train_noise = false;
+    eopts.quantities.var_input_noise = false;
+
+    PHZ_GPz::GPzOutput out;
+    make_predictions(eopts, gpz, spec, iout, spec.route(input), input, inputError, out,
+        state->ctx);
+
+    const uint_t nrow = input.rows();
+    bool has_unc = out.uncertainty.size() != 0;
+    for (uint_t i : range(nrow)) {
+        double truth = output[i];
+        double value = out.value[i];
+        if (!is_finite(truth) || !is_finite(value)) continue;
+
+        double unc = (has_unc ? out.uncertainty[i] : dnan);
+        state->total.add(truth, value, unc, opts);
+        if (opts.evaluate_bin > 0.0) {
+            state->bins[std::int64_t(floor(truth/opts.evaluate_bin))].add(truth, value, unc, opts);
+        }
+    }
+}
+
+bool evaluation_t::write(const options_t& opts, const std::string& sample,
+    std::ofstream& fout) const {
+
+    using namespace evaluate_impl;
+
+    state->ctx.report(opts);
+
+    const metrics_t& total = state->total;
+    const std::string& t = opts.output_column;
+    fout << "# sample: " << sample << "\n";
+    fout << "# dz = " << (opts.evaluate_relative ? "(value - "+t+")/(1 + "+t+")" : "value - "+t)
+        << "\n";
+    write_metrics(fout, total);
+
+    fout << "# PIT histogram\n";
+    fout << "# pit_min pit_max fraction\n";
+    for (uint_t i : range(npit)) {
+        fout << double(i)/npit << " " << double(i+1)/npit << " "
+            << (total.nunc > 0 ? double(total.pit[i])/total.nunc : dnan) << "\n";
+    }
+
+    if (opts.evaluate_bin > 0.0) {
+        fout << "# binned diagnostics, in bins of " << opts.output_column << "\n";
+        fout << "# bin_min bin_max n_objects bias_median nmad outlier_fraction coverage_1sigma\n";
+        for (const auto& b : state->bins) {
+            const metrics_t& m = b.second;
+            fout << b.first*opts.evaluate_bin << " " << (b.first+1)*opts.evaluate_bin << " "
+                << m.n << " " << m.hist.quantile(0.5) << " " << m.hist.nmad() << " "
+                << double(m.noutlier)/m.n << " " << m.coverage(0) << "\n";
+        }
+    }
+
+    fout << "\n";
+    fout.flush();
+
+    if (!fout) {
+        error("could not write the evaluation of ", sample, " in '", opts.evaluate_file, "'");
+        return false;
+    }
+
+    if (opts.verbose) {
+        note("evaluation on ", sample, ": ", total.n, " objects, bias=", total.hist.quantile(0.5),
+            ", nmad=", total.hist.nmad(), ", outliers=", double(total.noutlier)/total.n);
+    }
+
+    return true;
+}
+
+bool evaluate_predictions(const options_t& opts, PHZ_GPz::GPz& gpz,
+    specialist_set_t& spec, uint_t iout,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec1d& output, const std::string& sample, std::ofstream& fout) {
+
+    const uint_t nrow = input.rows();
+    const uint_t block_size = evaluation_block_size(opts);
+
+    evaluation_t eval;
+    for (uint_t i0 = 0; i0 < nrow; i0 += block_size) {
+        uint_t nblock = std::min(block_size, nrow - i0);
+
+        PHZ_GPz::Vec2d binputError;
+        if (inputError.size() != 0) {
+            binputError = inputError.middleRows(i0, nblock);
+        }
+
+        eval.add(opts, gpz, spec, iout, input.middleRows(i0, nblock), binputError,
+            output.segment(i0, nblock));
+    }
+
+    return eval.write(opts, sample, fout);
+}
@@ -0,0 +1,300 @@
+#include "gpz++.hpp"
+
+// Row filter expressions
+// ----------------------
+//
+// Grammar (lowest to highest precedence):
+//   or      : and ('||' and)*
+//   and     : not ('&&' not)*
+//   not     : '!' not | compare
+//   compare : sum (('<' | '<=' | '>' | '>=' | '==' | '!=') sum)?
+//   sum     : product (('+' | '-') product)*
+//   product : unary (('*' | '/') unary)*
+//   unary   : '-' unary | primary
+//   primary : number | column | function '(' or ')' | '(' or ')'
+// Supported functions are abs(), isnan() and isfinite(). Boolean values are 1 or 0.
+// Comparisons follow IEEE rules: with a nan operand, '!=' is true and all others are false.
+
+namespace filter_impl {
+    struct parser_t {
+        const std::string& str;
+        const vec1s& header;
+        row_filter_t& filter;
+        uint_t pos = 0;
+        std::string err;
+
+        parser_t(const std::string& s, const vec1s& h, row_filter_t& f) :
+            str(s), header(h), filter(f) {}
+
+        void skip_spaces() {
+            while (pos < str.size() && (str[pos] == ' ' || str[pos] == '\t')) ++pos;
+        }
+
+        bool accept(const std::string& tok) {
+            skip_spaces();
+            if (str.compare(pos, tok.size(), tok) == 0) {
+                // Do not mistake '<=' for '<', etc.
+                if (tok.size() == 1 && pos+1 < str.size() && str[pos+1] == '=' &&
+                    (tok == "<" || tok == ">" || tok == "!")) {
+                    return false;
+                }
+
+                pos += tok.size();
+                return true;
+            }
+
+            return false;
+        }
+
+        uint_t add(row_filter_t::op_t op, uint_t a = npos, uint_t b = npos) {
+            row_filter_t::node_t n;
+            n.op = op;
+            n.a = a;
+            n.b = b;
+            filter.nodes.push_back(n);
+            return filter.nodes.size() - 1;
+        }
+
+        uint_t fail(const std::string& msg) {
+            if (err.empty()) {
+                err = msg+" at position "+to_string(pos+1);
+            }
+
+            return npos;
+        }
+
+        uint_t parse_or() {
+            uint_t a = parse_and();
+            while (a != npos && accept("||")) {
+                uint_t b = parse_and();
+                if (b == npos) return npos;
+                a = add(row_filter_t::op_t::lor, a, b);
+            }
+
+            return a;
+        }
+
+        uint_t parse_and() {
+            uint_t a = parse_not();
+            while (a != npos && accept("&&")) {
+                uint_t b = parse_not();
+                if (b == npos) return npos;
+                a = add(row_filter_t::op_t::land, a, b);
+            }
+
+            return a;
+        }
+
+        uint_t parse_not() {
+            if (accept("!")) {
+                uint_t a = parse_not();
+                if (a == npos) return npos;
+                return add(row_filter_t::op_t::lnot, a);
+            }
+
+            return parse_compare();
+        }
+
+        uint_t parse_compare() {
+            uint_t a = parse_sum();
+            if (a == npos) return npos;
+
+            row_filter_t::op_t op;
+            if      (accept("<=")) op = row_filter_t::op_t::le;
+            else if (accept(">=")) op = row_filter_t::op_t::ge;
+            else if (accept("==")) op = row_filter_t::op_t::eq;
+            else if (accept("!=")) op = row_filter_t::op_t::ne;
+            else if (accept("<"))  op = row_filter_t::op_t::lt;
+            else if (accept(">"))  op = row_filter_t::op_t::gt;
+            else return a;
+
+            uint_t b = parse_sum();
+            if (b == npos) return npos;
+            return add(op, a, b);
+        }
+
+        uint_t parse_sum() {
+            uint_t a = parse_product();
+            while (a != npos) {
+                row_filter_t::op_t op;
+                if      (accept("+")) op = row_filter_t::op_t::add;
+                else if (accept("-")) op = row_filter_t::op_t::sub;
+                else break;
+
+                uint_t b = parse_product();
+                if (b == npos) return npos;
+                a = add(op, a, b);
+            }
+
+            return a;
+        }
+
+        uint_t parse_product() {
+            uint_t a = parse_unary();
+            while (a != npos) {
+                row_filter_t::op_t op;
+                if      (accept("*")) op = row_filter_t::op_t::mul;
+                else if (accept("/")) op = row_filter_t::op_t::div;
+                else break;
+
+                uint_t b = parse_unary();
+                if (b == npos) return npos;
+                a = add(op, a, b);
+            }
+
+            return a;
+        }
+
+        uint_t parse_unary() {
+            if (accept("-")) {
+                uint_t a = parse_unary();
+                if (a == npos) return npos;
+                return add(row_filter_t::op_t::neg, a);
+            }
+
+            return parse_primary();
+        }
+
+        uint_t parse_primary() {
+            skip_spaces();
+            if (pos >= str.size()) {
+                return fail("unexpected end of expression");
+            }
+
+            if (accept("(")) {
+                uint_t a = parse_or();
+                if (a == npos) return npos;
+                if (!accept(")")) return fail("expected ')'");
+                return a;
+            }
+
+            char c = str[pos];
+            if (isdigit(c) || c == '.') {
+                const char* beg = str.c_str() + pos;
+                char* end = nullptr;
+                double v = strtod(beg, &end);
+                if (end == beg) return fail("could not read number");
+                pos += end - beg;
+
+                uint_t n = add(row_filter_t::op_t::constant);
+                filter.nodes[n].value = v;
+                return n;
+            }
+
+            if (isalpha(c) || c == '_') {
+                uint_t p0 = pos;
+                while (pos < str.size() && (isalnum(str[pos]) || str[pos] == '_' || str[pos] == '.')) {
+                    ++pos;
+                }
+
+                std::string name = to_lower(str.substr(p0, pos - p0));
+
+                skip_spaces();
+                if (pos < str.size() && str[pos] == '(') {
+                    row_filter_t::op_t op;
+                    if      (name == "abs")      op = row_filter_t::op_t::abs;
+                    else if (name == "isnan")    op = row_filter_t::op_t::isnan;
+                    else if (name == "isfinite") op = row_filter_t::op_t::isfinite;
+                    else {
+                        pos = p0;
+                        return fail("unknown function '"+name+"'");
+                    }
+
+                    accept("(");
+                    uint_t a = parse_or();
+                    if (a == npos) return npos;
+                    if (!accept(")")) return fail("expected ')'");
+                    return add(op, a);
+                }
+
+                uint_t col = where_first(header == name);
+                if (col == npos) {
+                    pos = p0;
+                    return fail("unknown column '"+name+"'");
+                }
+
+                uint_t slot = where_first(filter.columns == col);
+                if (slot == npos) {
+                    slot = filter.columns.size();
+                    filter.columns.push_back(col);
+                    filter.names.push_back(header[col]);
+                }
+
+                uint_t n = add(row_filter_t::op_t::column);
+                filter.nodes[n].column = slot;
+                return n;
+            }
+
+            return fail("unexpected character '"+std::string(1, c)+"'");
+        }
+    };
+}
+
+bool row_filter_t::empty() const {
+    return nodes.empty();
+}
+
+bool row_filter_t::compile(const std::string& expr, const vec1s& header) {
+    nodes.clear();
+    columns.clear();
+    names.clear();
+
+    filter_impl::parser_t parser(expr, header, *this);
+    root = parser.parse_or();
+    parser.skip_spaces();
+    if (root != npos && parser.pos != expr.size()) {
+        parser.fail("unexpected character '"+std::string(1, expr[parser.pos])+"'");
+        root = npos;
+    }
+
+    if (root == npos) {
+        error("could not parse row filter '", expr, "'");
+        error(parser.err);
+        nodes.clear();
+        return false;
+    }
+
+    values.resize(columns.size());
+    return true;
+}
+
+double row_filter_t::evaluate_node(uint_t i) const {
+    const node_t& n = nodes[i];
+    switch (n.op) {
+    case op_t::constant: return n.value;
+    case op_t::column:   return values[n.column];
+    case op_t::neg:      return -evaluate_node(n.a);
+    case op_t::lnot:     return evaluate_node(n.a) != 0.0 ? 0.0 : 1.0;
+    case op_t::abs:      return std::abs(evaluate_node(n.a));
+    case op_t::isnan:    return std::isnan(evaluate_node(n.a)) ? 1.0 : 0.0;
+    case op_t::isfinite: return is_finite(evaluate_node(n.a)) ? 1.0 : 0.0;
+    case op_t::add:      return evaluate_node(n.a) + evaluate_node(n.b);
+    case op_t::sub:      return evaluate_node(n.a) - evaluate_node(n.b);
+    case op_t::mul:      return evaluate_node(n.a) * evaluate_node(n.b);
+    case op_t::div:      return evaluate_node(n.a) / evaluate_node(n.b);
+    case op_t::lt:       return evaluate_node(n.a) <  evaluate_node(n.b) ? 1.0 : 0.0;
+    case op_t::le:       return evaluate_node(n.a) <= evaluate_node(n.b) ? 1.0 : 0.0;
+    case op_t::gt:       return evaluate_node(n.a) >  evaluate_node(n.b) ? 1.0 : 0.0;
+    case op_t::ge:       return evaluate_node(n.a) >= evaluate_node(n.b) ? 1.0 : 0.0;
+    case op_t::eq:       return evaluate_node(n.a) == evaluate_node(n.b) ? 1.0 : 0.0;
+    case op_t::ne:       return evaluate_node(n.a) != evaluate_node(n.b) ? 1.0 : 0.0;
+    case op_t::land:     return evaluate_node(n.a) != 0.0 && evaluate_node(n.b) != 0.0 ? 1.0 : 0.0;
+    case op_t::lor:      return evaluate_node(n.a) != 0.0 || evaluate_node(n.b) != 0.0 ? 1.0 : 0.0;
+    }
+
+    return dnan;
+}
+
+bool row_filter_t::evaluate(const vec1s& spl, bool& pass) const {
+    // Only convert the columns used by the filter
+    for (uint_t i : range(columns)) {
+        if (!from_string(spl[columns[i]], values[i])) {
+            error("could not read value of column '", names[i], "' for ROW_FILTER");
+            note("must be a number, got: '", spl[columns[i]], "'");
+            return false;
+        }
+    }
+
+    pass = evaluate_node(root) != 0.0;
+    return true;
+}
@@ -0,0 +1,78 @@
+#include "gpz++.hpp"
+#include <sys/stat.h>
+
+// 64 bit FNV-1a hash
+std::uint64_t hash_bytes(const void* data, std::size_t size, std::uint64_t seed) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    std::uint64_t h = seed;
+    for (std::size_t i = 0; i < size; ++i) {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+std::uint64_t hash_string(const std::string& str, std::uint64_t seed) {
+    // Include the size, so that consecutive strings cannot be confused
+    std::uint64_t n = str.size();
+    seed = hash_bytes(&n, sizeof(n), seed);
+    return hash_bytes(str.data(), str.size(), seed);
+}
+
+namespace hash_impl {
+    template<typename T>
+    void hash_array(const T& a, std::uint64_t& seed) {
+        std::uint64_t n = a.size();
+        seed = hash_bytes(&n, sizeof(n), seed);
+        seed = hash_bytes(a.data(), a.size()*sizeof(double), seed);
+    }
+}
+
+std::uint64_t hash_model(const PHZ_GPz::GPzModel& model, std::uint64_t seed) {
+    using hash_impl::hash_array;
+
+    hash_array(model.featureMean, seed);
+    hash_array(model.featureSigma, seed);
+    seed = hash_bytes(&model.outputMean, sizeof(double), seed);
+    hash_array(model.modelWeights, seed);
+    hash_array(model.modelInputPrior, seed);
+    hash_array(model.modelInvCovariance, seed);
+    hash_array(model.parameters.basisFunctionPositions, seed);
+    hash_array(model.parameters.basisFunctionLogRelevances, seed);
+    hash_array(model.parameters.uncertaintyBasisWeights, seed);
+    hash_array(model.parameters.uncertaintyBasisLogRelevances, seed);
+    seed = hash_bytes(&model.parameters.logUncertaintyConstant, sizeof(double), seed);
+    for (const auto& cov : model.parameters.basisFunctionCovariances) {
+        hash_array(cov, seed);
+    }
+
+    return seed;
+}
+
+std::string hash_hex(std::uint64_t h) {
+    std::ostringstream ss;
+    ss << std::hex << std::setfill('0') << std::setw(16) << h;
+    return ss.str();
+}
+
+// Cheap signature of a file's content: its size and last modification time
+std::uint64_t file_signature(const std::string& filename, std::uint64_t seed) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return hash_string("", seed);
+    }
+
+    std::int64_t size = st.st_size;
+#ifdef __APPLE__
+    std::int64_t mtime = st.st_mtimespec.tv_sec;
+    std::int64_t mtime_ns = st.st_mtimespec.tv_nsec;
+#else
+    std::int64_t mtime = st.st_mtim.tv_sec;
+    std::int64_t mtime_ns = st.st_mtim.tv_nsec;
+#endif
+
+    seed = hash_bytes(&size, sizeof(size), seed);
+    seed = hash_bytes(&mtime, sizeof(mtime), seed);
+    return hash_bytes(&mtime_ns, sizeof(mtime_ns), seed);
+}
@@ -0,0 +1,94 @@
+#include "gpz++.hpp"
+
+// Parse an integer ID, only if it can be written back identically
+bool parse_integer_id(const std::string& str, std::int64_t& v) {
+    uint_t n = str.size();
+    uint_t p0 = (n != 0 && str[0] == '-' ? 1 : 0);
+    if (n == p0 || n - p0 > 18) return false;
+    if (str[p0] == '0' && n - p0 > 1) return false;
+
+    std::int64_t r = 0;
+    for (uint_t i = p0; i < n; ++i) {
+        if (str[i] < '0' || str[i] > '9') return false;
+        r = 10*r + (str[i] - '0');
+    }
+
+    if (p0 == 1) {
+        if (r == 0) return false;
+        r = -r;
+    }
+
+    v = r;
+    return true;
+}
+
+uint_t id_column_t::size() const {
+    return (is_integer ? ivalue.size() : offset.size() - 1);
+}
+
+bool id_column_t::empty() const {
+    return size() == 0;
+}
+
+void id_column_t::clear() {
+    is_integer = true;
+    ivalue.clear();
+    arena.clear();
+    offset.assign(1, 0);
+    width = 0;
+}
+
+void id_column_t::reserve(uint_t n) {
+    if (is_integer) {
+        ivalue.reserve(n);
+    } else {
+        offset.reserve(n+1);
+    }
+}
+
+void id_column_t::convert_to_string() {
+    offset.reserve(ivalue.capacity()+1);
+    for (std::int64_t v : ivalue) {
+        arena += to_string(v);
+        offset.push_back(arena.size());
+    }
+
+    is_integer = false;
+    ivalue.clear();
+    ivalue.shrink_to_fit();
+}
+
+void id_column_t::push_back(const std::string& str) {
+    if (is_integer) {
+        std::int64_t v;
+        if (parse_integer_id(str, v)) {
+            ivalue.push_back(v);
+            width = std::max<uint_t>(width, str.size());
+            return;
+        }
+
+        convert_to_string();
+    }
+
+    arena += str;
+    offset.push_back(arena.size());
+    width = std::max<uint_t>(width, str.size());
+}
+
+std::string id_column_t::operator[](uint_t i) const {
+    if (is_integer) {
+        return to_string(ivalue[i]);
+    } else {
+        return arena.substr(offset[i], offset[i+1] - offset[i]);
+    }
+}
+
+void id_column_t::write(std::ostream& out, uint_t i, uint_t w) const {
+    if (is_integer) {
+        out << std::setw(w) << ivalue[i];
+    } else {
+        uint_t len = offset[i+1] - offset[i];
+        for (uint_t k = len; k < w; ++k) out.put(' ');
+        out.write(arena.data() + offset[i], len);
+    }
+}
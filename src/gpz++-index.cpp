@@ -0,0 +1,176 @@
+#include "gpz++.hpp"
+
+// Catalog row index
+// -----------------
+//
+// The index of a catalog is stored next to it, in a file with the extension '.gpzidx' added.
+// It contains the signature of the catalog (size and modification time) at the time the index
+// was built, the position and content of the header, the number of data rows, and the byte
+// offset and line number of every INDEX_STRIDE-th data row. An index whose signature does not
+// match the catalog is rebuilt. The softening parameter of TRANSFORM_INPUTS=flux_to_luptitude is
+// added to the index the first time it is computed over all the rows of a column, so that jobs
+// reading only a ROW_RANGE of the catalog do not need to scan the whole catalog again.
+
+namespace index_impl {
+    std::string index_file(const std::string& catalog) {
+        return catalog+".gpzidx";
+    }
+
+    bool build_index(const std::string& catalog, uint_t stride, catalog_index_t& index) {
+        std::ifstream in(catalog, std::ios::binary);
+        if (!in) {
+            error("could not open catalog '", catalog, "'");
+            return false;
+        }
+
+        index = catalog_index_t();
+        index.signature = file_signature(catalog);
+        index.stride = stride;
+
+        // Offsets are counted by hand, since std::getline does not remove '\r'
+        std::uint64_t pos = 0;
+        uint_t l = 0;
+        std::string line;
+        while (std::getline(in, line)) {
+            std::uint64_t start = pos;
+            pos += line.size() + 1;
+            ++l;
+
+            line = trim(line);
+            if (line.empty()) continue;
+
+            if (line[0] == '#') {
+                if (index.header.empty()) {
+                    std::string hdr = trim(line.substr(1));
+                    if (!hdr.empty()) {
+                        index.header_offset = start;
+                        index.header = to_lower(split_any_of(hdr, " \t\n\r"));
+                    }
+                }
+
+                continue;
+            }
+
+            if (index.nrow % stride == 0) {
+                index.offset.push_back(start);
+                index.line.push_back(l);
+            }
+
+            ++index.nrow;
+        }
+
+        return true;
+    }
+
+    bool read_index(const std::string& filename, catalog_index_t& index) {
+        std::ifstream in(filename);
+        if (!in) return false;
+
+        index = catalog_index_t();
+
+        std::string line;
+        bool in_offsets = false;
+        while (ascii::getline(in, line)) {
+            line = trim(line);
+            if (line.empty() || line[0] == '#') continue;
+
+            if (in_offsets) {
+                std::uint64_t off;
+                uint_t l;
+                std::istringstream ss(line);
+                if (!(ss >> off >> l)) return false;
+                index.offset.push_back(off);
+                index.line.push_back(l);
+                continue;
+            }
+
+            auto sp = line.find_first_of(' ');
+            std::string key = line.substr(0, sp);
+            std::string val = (sp == line.npos ? "" : trim(line.substr(sp+1)));
+
+            bool ok = true;
+            if      (key == "signature")     ok = bool(std::istringstream(val) >> std::hex >> index.signature);
+            else if (key == "header_offset") ok = from_string(val, index.header_offset);
+            else if (key == "columns")       index.header = split_any_of(val, " ");
+            else if (key == "rows")          ok = from_string(val, index.nrow);
+            else if (key == "stride")        ok = from_string(val, index.stride);
+            else if (key == "f0") {
+                std::string column, rule;
+                double f0;
+                std::istringstream ss(val);
+                ok = bool(ss >> column >> rule >> f0);
+                if (ok) index.f0[column+" "+rule] = f0;
+            }
+            else if (key == "offsets")       in_offsets = true;
+            else ok = false;
+
+            if (!ok) return false;
+        }
+
+        uint_t nexpected = (index.stride > 0 ? (index.nrow + index.stride - 1)/index.stride : 0);
+        return index.stride > 0 && index.offset.size() == nexpected;
+    }
+
+    bool write_index(const std::string& filename, const catalog_index_t& index) {
+        std::string tmp = filename+".tmp";
+
+        {
+            std::ofstream fout(tmp);
+            fout << "# GPz++ catalog index (do not edit)\n";
+            fout << "signature " << hash_hex(index.signature) << "\n";
+            fout << "header_offset " << index.header_offset << "\n";
+            fout << "columns " << collapse(index.header, " ") << "\n";
+            fout << "rows " << index.nrow << "\n";
+            fout << "stride " << index.stride << "\n";
+            fout << std::setprecision(17);
+            for (const auto& f : index.f0) {
+                fout << "f0 " << f.first << " " << f.second << "\n";
+            }
+            fout << "offsets\n";
+            for (uint_t i : range(index.offset.size())) {
+                fout << index.offset[i] << " " << index.line[i] << "\n";
+            }
+
+            fout.close();
+            if (!fout) return false;
+        }
+
+        return std::rename(tmp.c_str(), filename.c_str()) == 0;
+    }
+}
+
+bool get_catalog_index(const std::string& catalog, uint_t stride, bool verbose,
+    catalog_index_t& index) {
+
+    using namespace index_impl;
+
+    std::string filename = index_file(catalog);
+    if (read_index(filename, index) && index.signature == file_signature(catalog) &&
+        index.stride == stride) {
+        return true;
+    }
+
+    if (!build_index(catalog, stride, index)) {
+        return false;
+    }
+
+    if (!write_index(filename, index)) {
+        warning("could not save catalog index in '", filename, "'");
+    } else if (verbose) {
+        note("built catalog index '", filename, "' (", index.nrow, " rows)");
+    }
+
+    return true;
+}
+
+bool save_catalog_index(const std::string& catalog, const catalog_index_t& index) {
+    using namespace index_impl;
+
+    std::string filename = index_file(catalog);
+    if (!write_index(filename, index)) {
+        warning("could not save catalog index in '", filename, "'");
+        return false;
+    }
+
+    return true;
+}
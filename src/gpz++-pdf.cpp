@@ -0,0 +1,150 @@
+#include "gpz++.hpp"
+#include <cstring>
+#include <limits>
+
+// Gridded p(z) output
+// -------------------
+//
+// The predictive distribution of each object is a Gaussian of mean 'value' and standard
+// deviation 'uncertainty'. It is integrated over cells of width PDF_GRID_STEP centered on each
+// grid point, so the stored value is the probability of the output falling in that cell.
+//
+// File layout (native byte order):
+//   char[8]   magic "GPZPDF1"
+//   uint32    format (0: float32, 1: uint16, 2: uint8)
+//   uint32    byte order marker (0x01020304)
+//   uint64    number of rows
+//   uint64    number of grid points
+//   float64   first grid point
+//   float64   grid step
+// followed by one fixed-size record per row, in the same order as the output catalog:
+//   float32: the probability in each cell
+//   uint16, uint8: a float32 scale, followed by the quantized probability in each cell, with
+//                  p = q*scale.
+// Rows with no valid prediction are stored as NaN (or with a NaN scale).
+
+namespace pdf_impl {
+    enum format_t : std::uint32_t {
+        float32 = 0, uint16 = 1, uint8 = 2
+    };
+
+    template<typename T>
+    void write_raw(std::ofstream& fout, const T& v) {
+        fout.write(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    template<typename T>
+    void write_raw(std::ofstream& fout, const std::vector<T>& v) {
+        fout.write(reinterpret_cast<const char*>(v.data()), v.size()*sizeof(T));
+    }
+
+    template<typename T>
+    void quantize_block(const std::vector<float>& prob, uint_t nrow, uint_t ngrid,
+        std::vector<char>& buffer) {
+
+        const double qmax = std::numeric_limits<T>::max();
+        const uint_t record = sizeof(float) + ngrid*sizeof(T);
+        buffer.resize(nrow*record);
+
+        for (uint_t i : range(nrow)) {
+            const float* p = prob.data() + i*ngrid;
+            char* rec = buffer.data() + i*record;
+
+            float pmax = 0.0;
+            for (uint_t j : range(ngrid)) {
+                pmax = std::max(pmax, p[j]);
+            }
+
+            float scale = (pmax > 0.0 ? pmax/qmax : 0.0);
+            if (std::isnan(p[0])) scale = fnan;
+
+            T* q = reinterpret_cast<T*>(rec + sizeof(float));
+            std::memcpy(rec, &scale, sizeof(float));
+            for (uint_t j : range(ngrid)) {
+                q[j] = (scale > 0.0 ? T(p[j]/scale + 0.5) : T(0));
+            }
+        }
+    }
+
+    format_t get_format(const options_t& opts) {
+        if      (opts.pdf_format == "uint16") return uint16;
+        else if (opts.pdf_format == "uint8")  return uint8;
+        else                                  return float32;
+    }
+}
+
+uint_t pdf_grid_size(const options_t& opts) {
+    return floor((opts.pdf_grid_max - opts.pdf_grid_min)/opts.pdf_grid_step + 0.5) + 1;
+}
+
+void write_pdf_header(std::ofstream& fout, const options_t& opts, uint_t nrow) {
+    using namespace pdf_impl;
+
+    fout.write("GPZPDF1", 8);
+    write_raw(fout, std::uint32_t(get_format(opts)));
+    write_raw(fout, std::uint32_t(0x01020304));
+    write_raw(fout, std::uint64_t(nrow));
+    write_raw(fout, std::uint64_t(pdf_grid_size(opts)));
+    write_raw(fout, opts.pdf_grid_min);
+    write_raw(fout, opts.pdf_grid_step);
+}
+
+void write_pdf_rows(std::ofstream& fout, const options_t& opts, const PHZ_GPz::GPzOutput& out) {
+    using namespace pdf_impl;
+
+    const format_t format = get_format(opts);
+    const double zmin = opts.pdf_grid_min;
+    const double dz = opts.pdf_grid_step;
+    const uint_t ngrid = pdf_grid_size(opts);
+    const uint_t nrow = out.value.size();
+
+    // Cell edges
+    std::vector<double> edge(ngrid+1);
+    for (uint_t j : range(ngrid+1)) {
+        edge[j] = zmin + (j - 0.5)*dz;
+    }
+
+    // Rows are processed in blocks, so the working buffers stay small and in cache
+    const uint_t block_size = 256;
+    std::vector<double> cdf(ngrid+1);
+    std::vector<float> prob(block_size*ngrid);
+    std::vector<char> buffer;
+
+    for (uint_t i0 = 0; i0 < nrow; i0 += block_size) {
+        uint_t nblock = std::min(block_size, nrow - i0);
+
+        for (uint_t i : range(nblock)) {
+            const double mu = out.value[i0+i];
+            const double sigma = out.uncertainty[i0+i];
+            float* p = prob.data() + i*ngrid;
+
+            if (!is_finite(mu) || !(sigma > 0.0) || !is_finite(sigma)) {
+                std::fill(p, p + ngrid, fnan);
+                continue;
+            }
+
+            const double norm = 1.0/(sqrt(2.0)*sigma);
+            for (uint_t j : range(ngrid+1)) {
+                cdf[j] = std::erf((edge[j] - mu)*norm);
+            }
+
+            for (uint_t j : range(ngrid)) {
+                p[j] = 0.5*(cdf[j+1] - cdf[j]);
+            }
+        }
+
+        switch (format) {
+        case float32:
+            fout.write(reinterpret_cast<const char*>(prob.data()), nblock*ngrid*sizeof(float));
+            break;
+        case uint16:
+            quantize_block<std::uint16_t>(prob, nblock, ngrid, buffer);
+            write_raw(fout, buffer);
+            break;
+        case uint8:
+            quantize_block<std::uint8_t>(prob, nblock, ngrid, buffer);
+            write_raw(fout, buffer);
+            break;
+        }
+    }
+}
@@ -0,0 +1,802 @@
+#include "gpz++.hpp"
+#include <Eigen/Dense>
+#include <random>
+
+// Copy the predictions of a subset of rows into the full output
+void copy_output_rows(const PHZ_GPz::GPzOutput& from, const vec1u& rows,
+    uint_t nrow, PHZ_GPz::GPzOutput& to) {
+
+    auto copy = [&](const PHZ_GPz::Vec1d& src, PHZ_GPz::Vec1d& dst) {
+        if (src.size() == 0) return;
+        if (uint_t(dst.size()) != nrow) {
+            dst = PHZ_GPz::Vec1d::Constant(nrow, dnan);
+        }
+
+        for (uint_t i : range(rows)) {
+            dst[rows[i]] = src[i];
+        }
+    };
+
+    copy(from.value,                to.value);
+    copy(from.uncertainty,          to.uncertainty);
+    copy(from.varianceTrainDensity, to.varianceTrainDensity);
+    copy(from.varianceTrainNoise,   to.varianceTrainNoise);
+    copy(from.varianceInputNoise,   to.varianceInputNoise);
+}
+
+// Extract a subset of rows from an input array (which may be empty)
+PHZ_GPz::Vec2d extract_rows(const PHZ_GPz::Vec2d& data, const vec1u& rows) {
+    PHZ_GPz::Vec2d sub;
+    if (data.size() == 0) return sub;
+
+    sub.resize(rows.size(), data.cols());
+    for (uint_t i : range(rows)) {
+        sub.row(i) = data.row(rows[i]);
+    }
+
+    return sub;
+}
+
+// Extract a subset of rows and columns from an input array (which may be empty)
+PHZ_GPz::Vec2d extract_rows(const PHZ_GPz::Vec2d& data, const vec1u& rows, const vec1u& cols) {
+    PHZ_GPz::Vec2d sub;
+    if (data.size() == 0) return sub;
+
+    sub.resize(rows.size(), cols.size());
+    for (uint_t i : range(rows))
+    for (uint_t j : range(cols)) {
+        sub(i,j) = data(rows[i],cols[j]);
+    }
+
+    return sub;
+}
+
+PHZ_GPz::Vec1d extract_rows(const PHZ_GPz::Vec1d& data, const vec1u& rows) {
+    PHZ_GPz::Vec1d sub;
+    if (data.size() == 0) return sub;
+
+    sub.resize(rows.size());
+    for (uint_t i : range(rows)) {
+        sub[i] = data[rows[i]];
+    }
+
+    return sub;
+}
+
+// Approximate prediction with basis function pruning
+// --------------------------------------------------
+//
+// Each basis function (BF) i is a Gaussian of the whitened features, centered on P_i and with
+// precision G_i^T G_i (G_i is stored in basisFunctionCovariances). Its contribution to a row x
+// is bounded by a_i*exp(-0.5*l_i*|x - P_i|^2), where l_i is the smallest eigenvalue of the
+// precision and a_i is the amplitude of the BF in the model: the largest of its weight, its
+// weight in the log noise variance, and 2*sum_j |S_ij|, with S = modelInvCovariance. Since
+// all the phi_j are at most one, removing BF i changes the variance phi^T S phi by at most
+// 2*phi_i*sum_j |S_ij| (the diagonal term S_ii alone is not a bound, as the off-diagonal terms
+// add up). The bound still holds when some features are missing (it only gets looser), and
+// with input noise if 1/l_i is increased by the largest noise variance in the row.
+//
+// A BF can therefore be ignored for a given row if |x - P_i|^2 > r_i^2, with:
+//   r_i^2 = 2*log(a_i/tol)*(1/l_i + e^2)
+// The rows are grouped into compact blocks, the BFs are stored in a k-d tree, and each block
+// is predicted with a reduced model containing only the BFs that can reach it. Blocks that
+// need the same BFs are predicted together, and the reduced models are kept for the next
+// calls (see prediction_context_t), so each is built and loaded once.
+
+namespace approx_impl {
+    struct box_t {
+        vec1d lo, hi;
+    };
+
+    // Squared distance between two boxes (zero if they overlap)
+    double box_distance2(const box_t& b1, const box_t& b2) {
+        double d2 = 0.0;
+        for (uint_t k : range(b1.lo)) {
+            double gap = std::max(0.0, std::max(b1.lo[k] - b2.hi[k], b2.lo[k] - b1.hi[k]));
+            if (is_finite(gap)) d2 += gap*gap;
+        }
+
+        return d2;
+    }
+
+    struct bf_tree_t {
+        struct node_t {
+            box_t box;
+            double max_radius_const = 0.0; // max of 2*log(a_i/tol)/l_i
+            double max_radius_noise = 0.0; // max of 2*log(a_i/tol)
+            uint_t i0 = 0, i1 = 0;
+            uint_t left = npos, right = npos;
+        };
+
+        std::vector<node_t> nodes;
+        vec1u ids;
+        vec1d radius_const, radius_noise;
+        const PHZ_GPz::Vec2d* pos = nullptr;
+
+        uint_t build(uint_t i0, uint_t i1) {
+            const uint_t nfeat = pos->cols();
+            const uint_t leaf_size = 8;
+
+            node_t node;
+            node.i0 = i0; node.i1 = i1;
+            node.box.lo = replicate(+dinf, nfeat);
+            node.box.hi = replicate(-dinf, nfeat);
+            for (uint_t i = i0; i < i1; ++i) {
+                for (uint_t k : range(nfeat)) {
+                    node.box.lo[k] = std::min(node.box.lo[k], (*pos)(ids[i],k));
+                    node.box.hi[k] = std::max(node.box.hi[k], (*pos)(ids[i],k));
+                }
+
+                node.max_radius_const = std::max(node.max_radius_const, radius_const[ids[i]]);
+                node.max_radius_noise = std::max(node.max_radius_noise, radius_noise[ids[i]]);
+            }
+
+            uint_t inode = nodes.size();
+            nodes.push_back(node);
+
+            if (i1 - i0 > leaf_size) {
+                // Split along the widest dimension
+                uint_t kmax = 0;
+                for (uint_t k : range(nfeat)) {
+                    if (node.box.hi[k] - node.box.lo[k] > node.box.hi[kmax] - node.box.lo[kmax]) {
+                        kmax = k;
+                    }
+                }
+
+                uint_t imid = (i0 + i1)/2;
+                std::nth_element(ids.data.begin() + i0, ids.data.begin() + imid,
+                    ids.data.begin() + i1, [&](uint_t a, uint_t b) {
+                        return (*pos)(a,kmax) < (*pos)(b,kmax);
+                    });
+
+                uint_t left = build(i0, imid);
+                uint_t right = build(imid, i1);
+                nodes[inode].left = left;
+                nodes[inode].right = right;
+            }
+
+            return inode;
+        }
+
+        void query(uint_t inode, const box_t& box, double noise2, vec1u& found) const {
+            const node_t& node = nodes[inode];
+            if (node.max_radius_const <= 0.0) return;
+
+            double d2 = box_distance2(node.box, box);
+            if (d2 >= node.max_radius_const + node.max_radius_noise*noise2) return;
+
+            if (node.left == npos) {
+                for (uint_t i = node.i0; i < node.i1; ++i) {
+                    uint_t b = ids[i];
+                    if (radius_const[b] <= 0.0) continue;
+
+                    box_t pbox;
+                    pbox.lo.resize(box.lo.size());
+                    for (uint_t k : range(pbox.lo)) pbox.lo[k] = (*pos)(b,k);
+                    pbox.hi = pbox.lo;
+
+                    if (box_distance2(pbox, box) < radius_const[b] + radius_noise[b]*noise2) {
+                        found.push_back(b);
+                    }
+                }
+            } else {
+                query(node.left,  box, noise2, found);
+                query(node.right, box, noise2, found);
+            }
+        }
+    };
+
+    // Split rows in compact blocks, by recursive median split along the widest dimension
+    void split_rows(const PHZ_GPz::Vec2d& x, vec1u& ids, uint_t i0, uint_t i1,
+        uint_t block_size, std::vector<vec1u>& blocks) {
+
+        if (i1 - i0 <= block_size) {
+            vec1u block;
+            block.data.assign(ids.data.begin() + i0, ids.data.begin() + i1);
+            blocks.push_back(block);
+            return;
+        }
+
+        uint_t kmax = 0;
+        double wmax = -1.0;
+        for (uint_t k : range(x.cols())) {
+            double lo = +dinf, hi = -dinf;
+            for (uint_t i = i0; i < i1; ++i) {
+                double v = x(ids[i],k);
+                if (is_finite(v)) {
+                    lo = std::min(lo, v);
+                    hi = std::max(hi, v);
+                }
+            }
+
+            if (hi - lo > wmax) {
+                wmax = hi - lo;
+                kmax = k;
+            }
+        }
+
+        // Missing values are sorted last
+        uint_t imid = (i0 + i1)/2;
+        std::nth_element(ids.data.begin() + i0, ids.data.begin() + imid,
+            ids.data.begin() + i1, [&](uint_t a, uint_t b) {
+                double va = x(a,kmax), vb = x(b,kmax);
+                if (!is_finite(va)) return false;
+                if (!is_finite(vb)) return true;
+                return va < vb;
+            });
+
+        split_rows(x, ids, i0, imid, block_size, blocks);
+        split_rows(x, ids, imid, i1, block_size, blocks);
+    }
+
+    PHZ_GPz::GPzModel reduce_model(const PHZ_GPz::GPzModel& model, const vec1u& bfs) {
+        PHZ_GPz::GPzModel sub;
+        sub.featureMean = model.featureMean;
+        sub.featureSigma = model.featureSigma;
+        sub.outputMean = model.outputMean;
+
+        const auto& par = model.parameters;
+        const uint_t nbf = bfs.size();
+        const uint_t nfeat = par.basisFunctionPositions.cols();
+
+        sub.modelWeights.resize(nbf);
+        sub.modelInputPrior.resize(nbf);
+        sub.modelInvCovariance.resize(nbf, nbf);
+        sub.parameters.basisFunctionPositions.resize(nbf, nfeat);
+        sub.parameters.basisFunctionLogRelevances.resize(nbf);
+        sub.parameters.uncertaintyBasisWeights.resize(nbf);
+        sub.parameters.uncertaintyBasisLogRelevances.resize(nbf);
+        sub.parameters.basisFunctionCovariances.resize(nbf);
+        sub.parameters.logUncertaintyConstant = par.logUncertaintyConstant;
+
+        for (uint_t i : range(bfs)) {
+            sub.modelWeights[i] = model.modelWeights[bfs[i]];
+            sub.modelInputPrior[i] = model.modelInputPrior[bfs[i]];
+            for (uint_t j : range(bfs)) {
+                sub.modelInvCovariance(i,j) = model.modelInvCovariance(bfs[i],bfs[j]);
+            }
+
+            sub.parameters.basisFunctionPositions.row(i) = par.basisFunctionPositions.row(bfs[i]);
+            sub.parameters.basisFunctionLogRelevances[i] = par.basisFunctionLogRelevances[bfs[i]];
+            sub.parameters.uncertaintyBasisWeights[i] = par.uncertaintyBasisWeights[bfs[i]];
+            sub.parameters.uncertaintyBasisLogRelevances[i] = par.uncertaintyBasisLogRelevances[bfs[i]];
+            sub.parameters.basisFunctionCovariances[i] = par.basisFunctionCovariances[bfs[i]];
+        }
+
+        return sub;
+    }
+}
+
+// Per-model state, see prediction_context_t
+struct prediction_context_t::model_state_t {
+    std::string label;
+
+    // APPROX_PREDICTION: BF tree of the full model, built on first use
+    bool approx_ready = false;
+    PHZ_GPz::GPzModel model;
+    approx_impl::bf_tree_t tree;
+    uint_t approx_nrow = 0, approx_nused = 0;
+    std::map<std::vector<uint_t>, PHZ_GPz::GPzModel> reduced; // reduced models, by BF list
+    uint_t reduced_nbf = 0; // total number of BFs in 'reduced'
+
+    // APPROX_PREDICTION: comparison against exact predictions, on the first
+    // APPROX_CHECK_SAMPLE rows predicted with this model
+    uint_t ncheck = 0;
+    double max_dval = 0.0, max_dunc = 0.0;
+
+    // OUTPUT_COLUMNS: direct predictor, built on first use
+    std::unique_ptr<single_predictor_t> single;
+    uint_t ndirect = 0, ngpz = 0;
+
+    // OUTPUT_COLUMNS: time taken by the skipped variance components, measured on the first
+    // rows (see select_impl::time_saved()) and extrapolated to all the rows
+    uint_t nsample_direct = 0, nsample_gpz = 0;
+    double dt_density = 0.0, dt_train_noise = 0.0, dt_variance = 0.0;
+};
+
+prediction_context_t::prediction_context_t() = default;
+prediction_context_t::~prediction_context_t() = default;
+
+prediction_context_t::model_state_t& prediction_context_t::state(const PHZ_GPz::GPz& gpz,
+    const std::string& label) {
+
+    auto iter = states.find(&gpz);
+    if (iter != states.end()) {
+        return *iter->second;
+    }
+
+    std::unique_ptr<model_state_t> st(new model_state_t);
+    st->label = label;
+    order.push_back(st.get());
+    return *(states[&gpz] = std::move(st));
+}
+
+void prediction_context_t::report(const options_t& opts) const {
+    for (const model_state_t* st : order) {
+        const std::string model = (st->label.empty() ? "" : " ("+st->label+")");
+
+        if (st->approx_ready) {
+            const uint_t nbf = st->model.modelWeights.size();
+            if (opts.verbose && st->approx_nrow != 0) {
+                note("approximate prediction", model, " used on average ",
+                    float(st->approx_nused)/st->approx_nrow, " basis functions per row (out of ",
+                    nbf, ")");
+            }
+
+            if (opts.verbose && st->ncheck != 0) {
+                note("approximate prediction error", model, " on ", st->ncheck,
+                    " rows: max |d(value)| = ", st->max_dval, ", max |d(uncertainty)| = ",
+                    st->max_dunc);
+            }
+
+            if (st->max_dval > nbf*opts.approx_tolerance) {
+                warning("approximate prediction error", model, " (", st->max_dval, ") is larger "
+                    "than expected (", nbf*opts.approx_tolerance, "), consider lowering "
+                    "APPROX_TOLERANCE");
+            }
+        }
+
+        if (st->single && opts.verbose) {
+            const output_quantities_t& q = opts.quantities;
+
+            std::string msg;
+            auto add = [&](const std::string& what, double dt, uint_t nsample, uint_t nrow) {
+                if (nsample == 0) return;
+                if (!msg.empty()) msg += ", ";
+                msg += what+" "+time_str(std::max(dt*nrow/nsample, 0.0));
+            };
+
+            if (!q.need_density()) {
+                add("var.density", st->dt_density, st->nsample_direct, st->ndirect);
+            }
+
+            if (!q.need_train_noise()) {
+                add("var.tr.noise", st->dt_train_noise, st->nsample_direct, st->ndirect);
+            }
+
+            if (!q.need_variance()) {
+                add("all variances (rows with input uncertainties)", st->dt_variance,
+                    st->nsample_gpz, st->ngpz);
+            }
+
+            if (!msg.empty()) {
+                note("time saved by OUTPUT_COLUMNS", model, " on ", st->ndirect + st->ngpz,
+                    " rows: ", msg);
+            }
+
+            if (st->ngpz != 0 && q.need_variance()) {
+                note(st->ngpz, " rows with input uncertainties or missing features needed all "
+                    "the variance components", model);
+            }
+        }
+    }
+}
+
+void predict_approx(const options_t& opts, PHZ_GPz::GPz& gpz,
+    prediction_context_t::model_state_t& st,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out) {
+
+    using namespace approx_impl;
+
+    const double tol = opts.approx_tolerance;
+    bf_tree_t& tree = st.tree;
+
+    if (!st.approx_ready) {
+        // Compute the reach of each basis function, once per model
+        st.approx_ready = true;
+        st.model = gpz.getModel();
+
+        const PHZ_GPz::GPzModel& model = st.model;
+        const auto& par = model.parameters;
+        const uint_t nbf = model.modelWeights.size();
+
+        tree.pos = &par.basisFunctionPositions;
+        tree.ids = uindgen(nbf);
+        tree.radius_const.resize(nbf);
+        tree.radius_noise.resize(nbf);
+        for (uint_t i : range(nbf)) {
+            PHZ_GPz::Vec2d precision = par.basisFunctionCovariances[i].transpose()*
+                par.basisFunctionCovariances[i];
+            double lmin = precision.selfadjointView<Eigen::Lower>().eigenvalues().minCoeff();
+
+            double amp = std::max(std::max(std::abs(model.modelWeights[i]), std::abs(par.uncertaintyBasisWeights[i])),
+                2.0*model.modelInvCovariance.row(i).cwiseAbs().sum());
+
+            if (amp > tol) {
+                tree.radius_noise[i] = 2.0*log(amp/tol);
+                tree.radius_const[i] = (lmin > 0.0 ? tree.radius_noise[i]/lmin : dinf);
+            } else {
+                tree.radius_noise[i] = 0.0;
+                tree.radius_const[i] = 0.0;
+            }
+        }
+
+        if (nbf != 0) {
+            tree.build(0, nbf);
+        }
+    }
+
+    const PHZ_GPz::GPzModel& model = st.model;
+    const uint_t nbf = model.modelWeights.size();
+    const uint_t nfeat = model.featureMean.size();
+    const uint_t nrow = input.rows();
+
+    // Whiten the inputs so they live in the same space as the BF positions
+    PHZ_GPz::Vec2d x(nrow, nfeat);
+    PHZ_GPz::Vec2d e2 = PHZ_GPz::Vec2d::Zero(nrow, nfeat);
+    for (uint_t i : range(nrow))
+    for (uint_t k : range(nfeat)) {
+        x(i,k) = (input(i,k) - model.featureMean[k])/model.featureSigma[k];
+        if (inputError.size() != 0 && is_finite(inputError(i,k))) {
+            e2(i,k) = sqr(inputError(i,k)/model.featureSigma[k]);
+        }
+    }
+
+    // Group rows into compact blocks
+    const uint_t block_size = 256;
+    std::vector<vec1u> blocks;
+    vec1u ids = uindgen(nrow);
+    if (nrow != 0) {
+        split_rows(x, ids, 0, nrow, block_size, blocks);
+    }
+
+    out = PHZ_GPz::GPzOutput();
+
+    // Find the BFs needed by each block, and group the blocks that need the same BFs
+    std::map<std::vector<uint_t>, vec1u> groups;
+    uint_t nused = 0;
+    for (const vec1u& rows : blocks) {
+
+        box_t box;
+        box.lo = replicate(+dinf, nfeat);
+        box.hi = replicate(-dinf, nfeat);
+        double noise2 = 0.0;
+        for (uint_t i : rows)
+        for (uint_t k : range(nfeat)) {
+            if (is_finite(x(i,k))) {
+                box.lo[k] = std::min(box.lo[k], x(i,k));
+                box.hi[k] = std::max(box.hi[k], x(i,k));
+                noise2 = std::max(noise2, e2(i,k));
+            } else {
+                // Missing feature: no constraint on this axis
+                box.lo[k] = -dinf;
+                box.hi[k] = +dinf;
+            }
+        }
+
+        vec1u bfs;
+        if (nbf != 0) {
+            tree.query(0, box, noise2, bfs);
+        }
+
+        if (bfs.empty()) {
+            // Keep at least the BF with the widest reach, so the model remains valid
+            uint_t best = 0;
+            for (uint_t i : range(nbf)) {
+                if (tree.radius_const[i] > tree.radius_const[best]) best = i;
+            }
+
+            bfs.push_back(best);
+        }
+
+        inplace_sort(bfs);
+        nused += bfs.size()*rows.size();
+
+        vec1u& grows = groups[bfs.data];
+        grows.data.insert(grows.data.end(), rows.begin(), rows.end());
+    }
+
+    // Predict each group with its reduced model; the memory used by the kept reduced models
+    // is capped to that of a few full models
+    const uint_t max_reduced_nbf = 16*nbf;
+    for (const auto& g : groups) {
+        const vec1u& rows = g.second;
+        if (g.first.size() == nbf) {
+            gpz.loadModel(model);
+        } else {
+            auto iter = st.reduced.find(g.first);
+            if (iter == st.reduced.end()) {
+                if (st.reduced_nbf + g.first.size() > max_reduced_nbf) {
+                    st.reduced.clear();
+                    st.reduced_nbf = 0;
+                }
+
+                st.reduced_nbf += g.first.size();
+                vec1u bfs;
+                bfs.data = g.first;
+                iter = st.reduced.emplace(g.first, reduce_model(model, bfs)).first;
+            }
+
+            gpz.loadModel(iter->second);
+        }
+
+        PHZ_GPz::GPzOutput tout = gpz.predict(extract_rows(input, rows), extract_rows(inputError, rows));
+        copy_output_rows(tout, rows, nrow, out);
+    }
+
+    // Restore full model
+    gpz.loadModel(model);
+
+    st.approx_nrow += nrow;
+    st.approx_nused += nused;
+
+    // Compare against exact prediction on a sample of rows, until APPROX_CHECK_SAMPLE rows
+    // have been checked for this model
+    uint_t nsample = std::min(opts.approx_check_sample - std::min(st.ncheck, opts.approx_check_sample), nrow);
+    if (nsample != 0) {
+        vec1u sample = uindgen(nrow);
+        std::mt19937 seed(42);
+        std::shuffle(sample.begin(), sample.end(), seed);
+        sample.resize(nsample);
+        inplace_sort(sample);
+
+        PHZ_GPz::GPzOutput exact = gpz.predict(extract_rows(input, sample), extract_rows(inputError, sample));
+
+        for (uint_t i : range(sample)) {
+            st.max_dval = std::max(st.max_dval, std::abs(out.value[sample[i]] - exact.value[i]));
+            if (exact.uncertainty.size() != 0) {
+                st.max_dunc = std::max(st.max_dunc, std::abs(out.uncertainty[sample[i]] - exact.uncertainty[i]));
+            }
+        }
+
+        st.ncheck += nsample;
+    }
+}
+
+void predict_all(const options_t& opts, PHZ_GPz::GPz& gpz,
+    prediction_context_t::model_state_t& st,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out) {
+
+    if (opts.approx_prediction) {
+        predict_approx(opts, gpz, st, input, inputError, out);
+    } else {
+        out = gpz.predict(input, inputError);
+    }
+}
+
+// Prediction of selected quantities
+// ---------------------------------
+//
+// GPz::predict computes either all the variance components, or none of them. When OUTPUT_COLUMNS
+// only needs some of them, rows without input uncertainties are predicted with the direct
+// evaluation of single_predictor_t, which computes only the needed components (the input noise
+// variance of these rows is zero). Other rows are given to GPz::predict, with variances
+// disabled if none are needed. The single predictor is built once per model (see
+// prediction_context_t). In verbose mode, the time saved by skipping each component is
+// estimated by computing it on the first rows predicted with each model, and reported once.
+
+namespace select_impl {
+    double time_direct(single_predictor_t& sp, const output_quantities_t& q,
+        const PHZ_GPz::Vec2d& input, const vec1u& rows) {
+
+        const output_quantities_t old = sp.quantities;
+        sp.quantities = q;
+
+        std::vector<double> flux(input.cols());
+        single_predictor_t::result_t r;
+        double t0 = now();
+        for (uint_t i : rows) {
+            for (uint_t k : range(flux.size())) flux[k] = input(i,k);
+            sp.predict_one(flux.data(), nullptr, r);
+        }
+
+        double dt = now() - t0;
+        sp.quantities = old;
+        return dt;
+    }
+
+    double time_gpz(PHZ_GPz::GPz& gpz, bool variance,
+        const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError) {
+
+        gpz.setPredictVariance(variance);
+        double t0 = now();
+        gpz.predict(input, inputError);
+        return now() - t0;
+    }
+
+    // Measure the time taken by the variance components that are not needed, on at most
+    // 'max_sample' rows of each kind for a given model
+    void time_saved(const options_t& opts, prediction_context_t::model_state_t& st,
+        PHZ_GPz::GPz& gpz, const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+        const vec1u& direct_rows, const vec1u& gpz_rows) {
+
+        const output_quantities_t& q = opts.quantities;
+        const uint_t max_sample = 256;
+
+        if (!direct_rows.empty() && st.nsample_direct < max_sample) {
+            vec1u sample = direct_rows;
+            if (sample.size() > max_sample - st.nsample_direct) {
+                sample.resize(max_sample - st.nsample_direct);
+            }
+
+            single_predictor_t& sp = *st.single;
+
+            output_quantities_t base;
+            base.uncertainty = base.var_density = base.var_train_noise = base.var_input_noise = false;
+            double t_value = time_direct(sp, base, input, sample);
+
+            if (!q.need_density()) {
+                output_quantities_t with = base;
+                with.var_density = true;
+                st.dt_density += time_direct(sp, with, input, sample) - t_value;
+            }
+
+            if (!q.need_train_noise()) {
+                output_quantities_t with = base;
+                with.var_train_noise = true;
+                st.dt_train_noise += time_direct(sp, with, input, sample) - t_value;
+            }
+
+            st.nsample_direct += sample.size();
+        }
+
+        if (!gpz_rows.empty() && !q.need_variance() && st.nsample_gpz < max_sample) {
+            vec1u sample = gpz_rows;
+            if (sample.size() > max_sample - st.nsample_gpz) {
+                sample.resize(max_sample - st.nsample_gpz);
+            }
+
+            PHZ_GPz::Vec2d sinput = extract_rows(input, sample);
+            PHZ_GPz::Vec2d sinputError = extract_rows(inputError, sample);
+            double t_all = time_gpz(gpz, true, sinput, sinputError);
+            double t_none = time_gpz(gpz, false, sinput, sinputError);
+            gpz.setPredictVariance(opts.predict_error);
+
+            st.dt_variance += t_all - t_none;
+            st.nsample_gpz += sample.size();
+        }
+    }
+}
+
+void predict_selected(const options_t& opts, PHZ_GPz::GPz& gpz,
+    prediction_context_t::model_state_t& st,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out) {
+
+    using namespace select_impl;
+
+    const output_quantities_t& q = opts.quantities;
+    const uint_t nrow = input.rows();
+    const uint_t nfeat = input.cols();
+    const bool has_error = inputError.size() != 0;
+
+    // Find which rows can be predicted directly
+    if (!st.single) {
+        st.single.reset(new single_predictor_t(opts, gpz));
+    }
+
+    single_predictor_t& sp = *st.single;
+    vec1u direct_rows, gpz_rows;
+    std::vector<double> flux(nfeat), err(nfeat);
+    for (uint_t i : range(nrow)) {
+        for (uint_t k : range(nfeat)) {
+            flux[k] = input(i,k);
+            if (has_error) err[k] = inputError(i,k);
+        }
+
+        if (sp.direct(flux.data(), has_error ? err.data() : nullptr)) {
+            direct_rows.push_back(i);
+        } else {
+            gpz_rows.push_back(i);
+        }
+    }
+
+    out = PHZ_GPz::GPzOutput();
+
+    if (!gpz_rows.empty()) {
+        // Variances cannot be computed separately by GPz::predict
+        gpz.setPredictVariance(q.need_variance());
+
+        PHZ_GPz::GPzOutput tout;
+        if (direct_rows.empty()) {
+            predict_all(opts, gpz, st, input, inputError, out);
+        } else {
+            predict_all(opts, gpz, st, extract_rows(input, gpz_rows),
+                extract_rows(inputError, gpz_rows), tout);
+            copy_output_rows(tout, gpz_rows, nrow, out);
+        }
+
+        gpz.setPredictVariance(opts.predict_error);
+    }
+
+    if (!direct_rows.empty()) {
+        auto allocate = [&](bool needed, PHZ_GPz::Vec1d& v) {
+            if (needed && uint_t(v.size()) != nrow) {
+                v = PHZ_GPz::Vec1d::Constant(nrow, dnan);
+            }
+        };
+
+        allocate(true,                 out.value);
+        allocate(q.uncertainty,        out.uncertainty);
+        allocate(q.need_density(),     out.varianceTrainDensity);
+        allocate(q.need_train_noise(), out.varianceTrainNoise);
+        allocate(q.need_input_noise(), out.varianceInputNoise);
+
+        single_predictor_t::result_t r;
+        for (uint_t i : direct_rows) {
+            for (uint_t k : range(nfeat)) flux[k] = input(i,k);
+            sp.predict_one(flux.data(), nullptr, r);
+
+            out.value[i] = r.value;
+            if (q.uncertainty)        out.uncertainty[i] = r.uncertainty;
+            if (q.need_density())     out.varianceTrainDensity[i] = r.variance_train_density;
+            if (q.need_train_noise()) out.varianceTrainNoise[i] = r.variance_train_noise;
+            if (q.need_input_noise()) out.varianceInputNoise[i] = r.variance_input_noise;
+        }
+    }
+
+    st.ndirect += direct_rows.size();
+    st.ngpz += gpz_rows.size();
+
+    if (opts.verbose) {
+        time_saved(opts, st, gpz, input, inputError, direct_rows, gpz_rows);
+    }
+}
+
+void make_predictions(const options_t& opts, PHZ_GPz::GPz& gpz,
+    prediction_context_t::model_state_t& st,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out) {
+
+    const output_quantities_t& q = opts.quantities;
+    if (opts.predict_error && !q.need_all()) {
+        predict_selected(opts, gpz, st, input, inputError, out);
+    } else {
+        predict_all(opts, gpz, st, input, inputError, out);
+    }
+
+    // Only keep the requested quantities
+    if (!q.uncertainty)     out.uncertainty.resize(0);
+    if (!q.var_density)     out.varianceTrainDensity.resize(0);
+    if (!q.var_train_noise) out.varianceTrainNoise.resize(0);
+    if (!q.var_input_noise) out.varianceInputNoise.resize(0);
+}
+
+void make_predictions(const options_t& opts, PHZ_GPz::GPz& gpz,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out,
+    prediction_context_t& ctx) {
+
+    make_predictions(opts, gpz, ctx.state(gpz), input, inputError, out);
+}
+
+void make_predictions(const options_t& opts, PHZ_GPz::GPz& gpz, specialist_set_t& spec,
+    uint_t iout, const std::vector<vec1u>& groups,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out,
+    prediction_context_t& ctx) {
+
+    const std::string output = (opts.output_columns.size() > 1 ?
+        "'"+opts.output_columns[iout]+"'" : "");
+
+    if (spec.empty()) {
+        make_predictions(opts, gpz, ctx.state(gpz, output), input, inputError, out);
+        return;
+    }
+
+    const uint_t nrow = input.rows();
+
+    out = PHZ_GPz::GPzOutput();
+    for (uint_t g : range(groups.size())) {
+        const vec1u& rows = groups[g];
+        if (rows.empty()) continue;
+
+        PHZ_GPz::GPz& model = (g == 0 ? gpz : spec.gpz[g-1][iout]);
+        prediction_context_t::model_state_t& st = ctx.state(model, (g == 0 ? "global model" :
+            "specialist model "+spec.patterns[g-1])+(output.empty() ? "" : " for "+output));
+
+        if (g == 0 && rows.size() == nrow) {
+            make_predictions(opts, model, st, input, inputError, out);
+            break;
+        }
+
+        PHZ_GPz::GPzOutput tout;
+        if (g == 0) {
+            make_predictions(opts, model, st, extract_rows(input, rows),
+                extract_rows(inputError, rows), tout);
+        } else {
+            // Specialists only see their observed features
+            const vec1u& cols = spec.features[g-1];
+            make_predictions(opts, model, st, extract_rows(input, rows, cols),
+                extract_rows(inputError, rows, cols), tout);
+        }
+
+        copy_output_rows(tout, rows, nrow, out);
+    }
+}
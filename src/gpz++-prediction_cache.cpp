@@ -0,0 +1,475 @@
+#include "gpz++.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+// Prediction cache
+// ----------------
+//
+// With PREDICTION_CACHE set, the predictions are stored in a persistent hash table on disk,
+// so that an object already predicted in a previous run (for example, a run on the same catalog
+// with another ROW_RANGE, or the same object in two overlapping catalogs) is not predicted
+// again. An entry is identified by the exact bytes of the
+// features and uncertainties of the object (after TRANSFORM_INPUTS), and by a context key built
+// from the models (including specialists) and the options that change the predicted values.
+// Entries of different contexts can share the same file. With flux_to_luptitude, the softening
+// parameter of the luptitudes must be fixed with LUPTITUDE_F0 (and is part of the context), so
+// that the features of an object are the same in all the catalogs it appears in.
+//
+// The table uses open addressing with linear probing, and is grown (doubled and rehashed)
+// when more than half of the slots are used. It is only accessed under a file lock (shared
+// for lookups, exclusive for insertions), so several runs can use the same cache at once.
+// A grown table is written to a new file, which then replaces the old one; a run that was
+// waiting for the lock of the old file opens the new one instead. A cache made for another
+// number of features or outputs is never modified: the run stops with an error.
+//
+// File layout (native byte order): header_t, then nslot slots of:
+//   tag (hash of the row and context, never zero for a used slot), context, presence mask
+//   (one bit per stored quantity), features, uncertainties, then for each output the value,
+//   uncertainty, and the three variance components.
+
+namespace prediction_cache_impl {
+    const char magic[8] = {'G', 'P', 'Z', 'P', 'C', 'A', 'C', 'H'};
+    const std::uint32_t format_version = 1;
+    const uint_t nquantity = 5;
+    const uint_t min_slots = 1024;
+
+    struct header_t {
+        char magic[8];
+        std::uint32_t version = format_version;
+        std::uint32_t nfeature = 0;
+        std::uint32_t noutput = 0;
+        std::uint32_t padding = 0;
+        std::uint64_t nslot = 0;
+        std::uint64_t nused = 0;
+    };
+
+    std::uint64_t mix(std::uint64_t x) {
+        x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27))*0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    const PHZ_GPz::Vec1d& quantity(const PHZ_GPz::GPzOutput& out, uint_t q) {
+        switch (q) {
+            case 0:  return out.value;
+            case 1:  return out.uncertainty;
+            case 2:  return out.varianceTrainDensity;
+            case 3:  return out.varianceTrainNoise;
+            default: return out.varianceInputNoise;
+        }
+    }
+
+    PHZ_GPz::Vec1d& quantity(PHZ_GPz::GPzOutput& out, uint_t q) {
+        const PHZ_GPz::GPzOutput& cout = out;
+        return const_cast<PHZ_GPz::Vec1d&>(quantity(cout, q));
+    }
+
+    // Open file holding a lock, released on destruction. The file may be replaced (see
+    // prediction_cache_t::insert()) while waiting for the lock, in which case the new file
+    // is opened.
+    struct locked_file_t {
+        int fd = -1;
+
+        locked_file_t(const std::string& filename, bool write) {
+            while (true) {
+                fd = (write ? open(filename.c_str(), O_RDWR | O_CREAT, 0644) :
+                    open(filename.c_str(), O_RDONLY));
+                if (fd < 0) return;
+
+                if (flock(fd, write ? LOCK_EX : LOCK_SH) != 0) {
+                    close(fd);
+                    fd = -1;
+                    return;
+                }
+
+                struct stat sfd, sname;
+                if (fstat(fd, &sfd) == 0 && stat(filename.c_str(), &sname) == 0 &&
+                    sfd.st_dev == sname.st_dev && sfd.st_ino == sname.st_ino) {
+                    return;
+                }
+
+                flock(fd, LOCK_UN);
+                close(fd);
+            }
+        }
+
+        ~locked_file_t() {
+            if (fd >= 0) {
+                flock(fd, LOCK_UN);
+                close(fd);
+            }
+        }
+
+        std::uint64_t size() const {
+            struct stat st;
+            return (fstat(fd, &st) == 0 ? st.st_size : 0);
+        }
+
+        locked_file_t(const locked_file_t&) = delete;
+        locked_file_t& operator=(const locked_file_t&) = delete;
+    };
+
+    // Mapping of a file in memory
+    struct mapping_t {
+        char* data = nullptr;
+        std::size_t size = 0;
+
+        mapping_t(int fd, std::size_t n, bool write) {
+            if (n == 0) return;
+            void* p = mmap(nullptr, n, write ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<char*>(p);
+                size = n;
+            }
+        }
+
+        ~mapping_t() {
+            if (data) munmap(data, size);
+        }
+
+        mapping_t(const mapping_t&) = delete;
+        mapping_t& operator=(const mapping_t&) = delete;
+    };
+
+    bool is_cache(const header_t& hdr) {
+        return std::memcmp(hdr.magic, magic, sizeof(magic)) == 0;
+    }
+
+    bool read_header(const locked_file_t& f, header_t& hdr) {
+        return f.size() >= sizeof(hdr) && pread(f.fd, &hdr, sizeof(hdr), 0) == ssize_t(sizeof(hdr));
+    }
+}
+
+bool prediction_cache_t::init(const options_t& opts, const std::vector<PHZ_GPz::GPz>& gpz,
+    const specialist_set_t& spec, uint_t nfeat, bool with_errors) {
+
+    filename = opts.prediction_cache;
+    if (filename.empty()) return true;
+
+    nfeature = nfeat;
+    noutput = gpz.size();
+    has_error = with_errors;
+    slot_size = 3*sizeof(std::uint64_t) +
+        (2*nfeature + prediction_cache_impl::nquantity*noutput)*sizeof(double);
+
+    // Everything that changes the predicted values for a given row. Models are written with
+    // full precision (see write_model()), so a model trained in this run and the same model
+    // read back from MODEL_FILE or MODEL_CACHE_DIR in a later run have the same hash.
+    std::uint64_t h = hash_seed;
+    h = hash_string(gpzpp_version, h);
+    for (const auto& g : gpz) {
+        h = hash_model(g.getModel(), h);
+    }
+
+    for (uint_t s : range(spec.patterns)) {
+        h = hash_string(spec.patterns[s], h);
+        for (const auto& g : spec.gpz[s]) {
+            h = hash_model(g.getModel(), h);
+        }
+    }
+
+    std::ostringstream ss;
+    ss << std::setprecision(17) << has_error << ' ' << opts.predict_error << ' '
+        << opts.approx_prediction << ' ' << opts.approx_tolerance << ' '
+        << collapse(opts.output_quantities, ",") << '\n' << opts.transform_inputs;
+
+    // With flux_to_luptitude, read_config() requires a fixed LUPTITUDE_F0, so the features of
+    // an object do not depend on the catalog it was read from
+    for (double f0 : opts.luptitude_f0) {
+        ss << ' ' << f0;
+    }
+
+    context = hash_string(ss.str(), h);
+
+    // Check that an existing file is a prediction cache made for these features and outputs,
+    // and never overwrite it otherwise
+    if (file::exists(filename)) {
+        using namespace prediction_cache_impl;
+
+        locked_file_t f(filename, false);
+        header_t hdr;
+        if (f.fd < 0 || (f.size() != 0 && (!read_header(f, hdr) || !is_cache(hdr)))) {
+            error("'", filename, "' is not a prediction cache, please choose another file for "
+                "PREDICTION_CACHE");
+            return false;
+        }
+
+        if (f.size() != 0) {
+            if (hdr.version != format_version) {
+                error("prediction cache '", filename, "' was made with another version of "
+                    "GPz++, please choose another file for PREDICTION_CACHE");
+                return false;
+            }
+
+            if (hdr.nfeature != nfeature || hdr.noutput != noutput) {
+                error("prediction cache '", filename, "' was made for ", hdr.nfeature,
+                    " features and ", hdr.noutput, " outputs, but this run has ", nfeature,
+                    " features and ", noutput, " outputs; please choose another file for "
+                    "PREDICTION_CACHE");
+                return false;
+            }
+
+            if (f.size() != sizeof(hdr) + hdr.nslot*slot_size) {
+                error("prediction cache '", filename, "' is corrupted, please remove it or "
+                    "choose another file for PREDICTION_CACHE");
+                return false;
+            }
+        }
+    }
+
+    enabled = true;
+    return true;
+}
+
+void prediction_cache_t::row_bytes(const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    uint_t i, std::vector<double>& buffer) const {
+
+    buffer.resize(2*nfeature);
+    for (uint_t k : range(nfeature)) {
+        buffer[k] = input(i,k);
+        buffer[nfeature + k] = (has_error ? inputError(i,k) : 0.0);
+    }
+}
+
+vec1u prediction_cache_t::lookup(const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    std::vector<PHZ_GPz::GPzOutput>& out) {
+
+    using namespace prediction_cache_impl;
+
+    const uint_t nrow = input.rows();
+    out.assign(noutput, PHZ_GPz::GPzOutput());
+    nlookup += nrow;
+
+    vec1u miss;
+    for (uint_t i : range(nrow)) miss.push_back(i);
+    if (!file::exists(filename)) return miss;
+
+    locked_file_t f(filename, false);
+    header_t hdr;
+    if (f.fd < 0 || !read_header(f, hdr) || !is_cache(hdr) || hdr.version != format_version ||
+        hdr.nfeature != nfeature || hdr.noutput != noutput ||
+        f.size() != sizeof(hdr) + hdr.nslot*slot_size) {
+        return miss;
+    }
+
+    mapping_t map(f.fd, f.size(), false);
+    if (!map.data) return miss;
+
+    const char* slots = map.data + sizeof(hdr);
+    const std::uint64_t mask = hdr.nslot - 1;
+    const std::size_t row_size = 2*nfeature*sizeof(double);
+
+    miss.clear();
+    std::vector<double> row;
+    for (uint_t i : range(nrow)) {
+        row_bytes(input, inputError, i, row);
+        std::uint64_t tag = hash_bytes(row.data(), row_size, context) | 1;
+
+        const char* found = nullptr;
+        for (std::uint64_t s = mix(tag) & mask;; s = (s + 1) & mask) {
+            const char* slot = slots + s*slot_size;
+            std::uint64_t head[3];
+            std::memcpy(head, slot, sizeof(head));
+            if (head[0] == 0) break;
+            if (head[0] == tag && head[1] == context &&
+                std::memcmp(slot + sizeof(head), row.data(), row_size) == 0) {
+                found = slot;
+                break;
+            }
+        }
+
+        if (!found) {
+            miss.push_back(i);
+            continue;
+        }
+
+        std::uint64_t present;
+        std::memcpy(&present, found + 2*sizeof(std::uint64_t), sizeof(present));
+        const char* values = found + 3*sizeof(std::uint64_t) + row_size;
+        for (uint_t m : range(noutput))
+        for (uint_t q : range(nquantity)) {
+            if (!(present & (1ull << q))) continue;
+
+            PHZ_GPz::Vec1d& v = quantity(out[m], q);
+            if (uint_t(v.size()) != nrow) {
+                v = PHZ_GPz::Vec1d::Constant(nrow, dnan);
+            }
+
+            std::memcpy(&v[i], values + (m*nquantity + q)*sizeof(double), sizeof(double));
+        }
+    }
+
+    nhit += nrow - miss.size();
+
+    return miss;
+}
+
+void prediction_cache_t::insert(const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const vec1u& rows, const std::vector<PHZ_GPz::GPzOutput>& out) {
+
+    using namespace prediction_cache_impl;
+
+    if (rows.empty()) return;
+
+    locked_file_t f(filename, true);
+    if (f.fd < 0) {
+        warning("could not open prediction cache '", filename, "' for writing, disabling it");
+        enabled = false;
+        return;
+    }
+
+    header_t hdr;
+    bool valid = read_header(f, hdr) && is_cache(hdr) && hdr.version == format_version &&
+        hdr.nfeature == nfeature && hdr.noutput == noutput &&
+        f.size() == sizeof(hdr) + hdr.nslot*slot_size;
+
+    if (!valid && f.size() != 0) {
+        // Checked in init(), so the file was changed by another run since: leave it alone
+        warning("prediction cache '", filename, "' was replaced by an incompatible file, "
+            "disabling it");
+        enabled = false;
+        return;
+    }
+
+    const std::size_t row_size = 2*nfeature*sizeof(double);
+
+    // Insert one entry in a table, unless it is already there
+    auto place = [&](char* slots, std::uint64_t nslot, const char* entry) {
+        std::uint64_t tag, ctx;
+        std::memcpy(&tag, entry, sizeof(tag));
+        std::memcpy(&ctx, entry + sizeof(tag), sizeof(ctx));
+
+        const std::uint64_t mask = nslot - 1;
+        for (std::uint64_t s = mix(tag) & mask;; s = (s + 1) & mask) {
+            char* slot = slots + s*slot_size;
+            std::uint64_t stag, sctx;
+            std::memcpy(&stag, slot, sizeof(stag));
+            std::memcpy(&sctx, slot + sizeof(stag), sizeof(sctx));
+            if (stag == 0) {
+                std::memcpy(slot, entry, slot_size);
+                return true;
+            }
+
+            if (stag == tag && sctx == ctx &&
+                std::memcmp(slot + 3*sizeof(std::uint64_t), entry + 3*sizeof(std::uint64_t),
+                row_size) == 0) {
+                return false;
+            }
+        }
+    };
+
+    // Build the new entries
+    std::vector<char> entries(rows.size()*slot_size);
+    std::vector<double> row;
+    for (uint_t j : range(rows)) {
+        const uint_t i = rows[j];
+        char* entry = entries.data() + j*slot_size;
+
+        row_bytes(input, inputError, i, row);
+        std::uint64_t tag = hash_bytes(row.data(), row_size, context) | 1;
+        std::uint64_t present = 0;
+        for (uint_t q : range(nquantity)) {
+            if (quantity(out[0], q).size() != 0) present |= 1ull << q;
+        }
+
+        std::memcpy(entry, &tag, sizeof(tag));
+        std::memcpy(entry + sizeof(tag), &context, sizeof(context));
+        std::memcpy(entry + 2*sizeof(tag), &present, sizeof(present));
+        std::memcpy(entry + 3*sizeof(tag), row.data(), row_size);
+
+        char* values = entry + 3*sizeof(tag) + row_size;
+        for (uint_t m : range(noutput))
+        for (uint_t q : range(nquantity)) {
+            const PHZ_GPz::Vec1d& v = quantity(out[m], q);
+            double d = (v.size() != 0 ? v[i] : dnan);
+            std::memcpy(values + (m*nquantity + q)*sizeof(double), &d, sizeof(double));
+        }
+    }
+
+    const std::uint64_t nused = (valid ? hdr.nused : 0);
+    if (valid && 2*(nused + rows.size()) <= hdr.nslot) {
+        // Insert in place
+        mapping_t map(f.fd, f.size(), true);
+        if (!map.data) {
+            warning("could not map prediction cache '", filename, "' in memory, disabling it");
+            enabled = false;
+            return;
+        }
+
+        char* slots = map.data + sizeof(hdr);
+        for (uint_t j : range(rows)) {
+            if (place(slots, hdr.nslot, entries.data() + j*slot_size)) {
+                ++hdr.nused;
+            }
+        }
+
+        std::memcpy(map.data, &hdr, sizeof(hdr));
+        return;
+    }
+
+    // Grow the table: rehash all the entries into a new file, which then replaces the old one
+    std::uint64_t nslot = min_slots;
+    while (nslot < 2*(nused + rows.size())) nslot *= 2;
+
+    header_t nhdr;
+    std::memcpy(nhdr.magic, magic, sizeof(magic));
+    nhdr.nfeature = nfeature;
+    nhdr.noutput = noutput;
+    nhdr.nslot = nslot;
+
+    const std::string tmp = filename+".tmp";
+    const std::size_t size = sizeof(nhdr) + nslot*slot_size;
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    bool success = fd >= 0 && ftruncate(fd, size) == 0;
+    if (success) {
+        // The file starts filled with zeros, i.e., empty slots
+        mapping_t nmap(fd, size, true);
+        success = nmap.data != nullptr;
+        if (success) {
+            char* nslots = nmap.data + sizeof(nhdr);
+
+            if (valid) {
+                // Without the old entries, the new file must not replace the old one
+                mapping_t map(f.fd, f.size(), false);
+                success = map.data != nullptr;
+                if (success) {
+                    const char* slots = map.data + sizeof(hdr);
+                    for (std::uint64_t s = 0; s < hdr.nslot; ++s) {
+                        std::uint64_t tag;
+                        std::memcpy(&tag, slots + s*slot_size, sizeof(tag));
+                        if (tag != 0 && place(nslots, nslot, slots + s*slot_size)) {
+                            ++nhdr.nused;
+                        }
+                    }
+                }
+            }
+
+            if (success) {
+                for (uint_t j : range(rows)) {
+                    if (place(nslots, nslot, entries.data() + j*slot_size)) {
+                        ++nhdr.nused;
+                    }
+                }
+
+                std::memcpy(nmap.data, &nhdr, sizeof(nhdr));
+            }
+        }
+    }
+
+    if (fd >= 0 && close(fd) != 0) {
+        success = false;
+    }
+
+    // Replace the old file while still holding its lock; on failure, the old file is kept
+    if (!success || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+        warning("could not grow prediction cache '", filename, "', keeping it as it is and "
+            "disabling it");
+        std::remove(tmp.c_str());
+        enabled = false;
+    }
+}
@@ -0,0 +1,169 @@
+#include "gpz++.hpp"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Phases are recorded in a plain list, which is not protected against concurrent access:
+// profile_start(), profile_resume() and profile_stop() must only be called from the main thread
+// (not from the workers of run_concurrently(), for example).
+//
+// The operating system only reports the peak memory usage of the whole process since it
+// started, which is reported for each phase as cumulative_peak_rss_mb (it is the same for all
+// the phases after the one that used the most memory). The memory used by a phase itself is
+// given by rss_delta_mb, the change of the current memory usage between the start and the end
+// of the phase (summed if the phase was resumed); memory allocated and released within the
+// phase is not counted.
+
+namespace profile_impl {
+    struct phase_t {
+        std::string name;
+        double wall_start = 0.0, cpu_start = 0.0, rss_start = dnan;
+        double wall = dnan, cpu = dnan;
+        double peak_rss = dnan, rss_delta = dnan;
+        uint_t nrow = 0;
+    };
+
+    std::vector<phase_t> phases;
+    double wall_origin = now();
+
+    double cpu_time() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + 1e-6*usage.ru_utime.tv_usec +
+            usage.ru_stime.tv_sec + 1e-6*usage.ru_stime.tv_usec;
+    }
+
+    // Peak resident set size of the process so far, in MB
+    double peak_rss() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+    #ifdef __APPLE__
+        return usage.ru_maxrss/(1024.0*1024.0);
+    #else
+        return usage.ru_maxrss/1024.0;
+    #endif
+    }
+
+    // Current resident set size of the process, in MB
+    double current_rss() {
+    #ifdef __linux__
+        std::ifstream in("/proc/self/statm");
+        std::uint64_t size = 0, resident = 0;
+        if (in >> size >> resident) {
+            return resident*double(sysconf(_SC_PAGESIZE))/(1024.0*1024.0);
+        }
+    #endif
+
+        return dnan;
+    }
+
+    std::string json_string(const std::string& str) {
+        std::string res = "\"";
+        for (char c : str) {
+            if (c == '"' || c == '\\') {
+                res += '\\';
+                res += c;
+            } else if (c == '\n') {
+                res += "\\n";
+            } else if (c == '\t') {
+                res += "\\t";
+            } else {
+                res += c;
+            }
+        }
+
+        return res + "\"";
+    }
+
+    std::string json_number(double v) {
+        if (!is_finite(v)) return "null";
+        std::ostringstream ss;
+        ss << std::setprecision(6) << v;
+        return ss.str();
+    }
+}
+
+uint_t profile_start(const std::string& name) {
+    using namespace profile_impl;
+
+    phase_t p;
+    p.name = name;
+    p.wall_start = now();
+    p.cpu_start = cpu_time();
+    p.rss_start = current_rss();
+    phases.push_back(p);
+
+    return phases.size() - 1;
+}
+
+void profile_resume(uint_t id) {
+    using namespace profile_impl;
+
+    phase_t& p = phases[id];
+    p.wall_start = now();
+    p.cpu_start = cpu_time();
+    p.rss_start = current_rss();
+}
+
+void profile_stop(uint_t id, uint_t nrow) {
+    using namespace profile_impl;
+
+    // Times and rows accumulate if the phase was resumed
+    phase_t& p = phases[id];
+    p.wall = (is_finite(p.wall) ? p.wall : 0.0) + now() - p.wall_start;
+    p.cpu = (is_finite(p.cpu) ? p.cpu : 0.0) + cpu_time() - p.cpu_start;
+    p.peak_rss = peak_rss();
+    p.rss_delta = (is_finite(p.rss_delta) ? p.rss_delta : 0.0) + current_rss() - p.rss_start;
+    p.nrow += nrow;
+}
+
+double profile_last(const std::string& name) {
+    using namespace profile_impl;
+
+    for (uint_t i : range(phases.size())) {
+        const phase_t& p = phases[phases.size()-1-i];
+        if (p.name == name) return p.wall;
+    }
+
+    return dnan;
+}
+
+bool write_profile(const options_t& opts, const PHZ_GPz::GPz& gpz) {
+    using namespace profile_impl;
+
+    if (opts.profile_file.empty()) return true;
+
+    std::ofstream fout(opts.profile_file);
+    if (!fout) {
+        error("could not open profile file '", opts.profile_file, "' for writing");
+        return false;
+    }
+
+    fout << "{\n";
+    fout << "  \"version\": " << json_string(gpzpp_version) << ",\n";
+    fout << "  \"git_hash\": " << json_string(gpzpp_git_hash) << ",\n";
+    fout << "  \"training_catalog\": " << json_string(opts.training_catalog) << ",\n";
+    fout << "  \"prediction_catalog\": " << json_string(opts.prediction_catalog) << ",\n";
+    fout << "  \"num_bf\": " << gpz.getNumberOfBasisFunctions() << ",\n";
+    fout << "  \"n_thread\": " << opts.n_thread << ",\n";
+    fout << "  \"total_wall_time\": " << json_number(now() - wall_origin) << ",\n";
+    fout << "  \"total_cpu_time\": " << json_number(cpu_time()) << ",\n";
+    fout << "  \"peak_rss_mb\": " << json_number(peak_rss()) << ",\n";
+    fout << "  \"phases\": [";
+    for (uint_t i : range(phases.size())) {
+        const phase_t& p = phases[i];
+        fout << (i == 0 ? "\n" : ",\n");
+        fout << "    {\"name\": " << json_string(p.name)
+             << ", \"wall_time\": " << json_number(p.wall)
+             << ", \"cpu_time\": " << json_number(p.cpu)
+             << ", \"cumulative_peak_rss_mb\": " << json_number(p.peak_rss)
+             << ", \"rss_delta_mb\": " << json_number(p.rss_delta)
+             << ", \"rows\": " << p.nrow
+             << ", \"rows_per_second\": " << json_number(p.nrow > 0 ? p.nrow/p.wall : dnan)
+             << "}";
+    }
+    fout << "\n  ]\n";
+    fout << "}\n";
+
+    return true;
+}
@@ -145,12 +145,21 @@ bool read_config(const std::string& filename, options_t& opts, PHZ_GPz::GPz& gpz
     vec1s unparsed_key, unparsed_val;
 
     PHZ_GPz::GPzOptimizations optim;
+    opts.n_thread = optim.maxThreads;
+
+    // GPz options that GPz can report
+    opts.num_bf = gpz.getNumberOfBasisFunctions();
+    opts.covariance = gpz.getCovarianceType();
+    opts.prior_mean = gpz.getPriorMeanFunction();
+    opts.weighting_scheme = gpz.getWeightingScheme();
+    opts.normalization_scheme = gpz.getNormalizationScheme();
+    opts.output_error_type = gpz.getOutputUncertaintyType();
 
     auto do_parse = [&](const std::string& key, const std::string& val) {
         #define PARSE_OPTION(name) if (key == #name) { return parse_value(key, val, opts.name); }
         #define PARSE_OPTION_RENAME(opt, name) if (key == name) { return parse_value(key, val, opts.opt); }
-        #define PARSE_OPTION_GPZ(name, type, func) if (key == #name) { type tmp; if (parse_value(key, val, tmp)) { gpz.func(tmp); return true; } else { return false; } }
-        #define PARSE_OPTION_GPZ_OPTIM(name, field) if (key == #name) { return parse_value(key, val, optim.field); }
+        #define PARSE_GPZ_OPTION(name) if (key == #name) { opts.gpz_options_set.insert(key); \
+            return parse_value(key, val, opts.name); }
 
         PARSE_OPTION(training_catalog)
         PARSE_OPTION(prediction_catalog)
@@ -164,37 +173,69 @@ bool read_config(const std::string& filename, options_t& opts, PHZ_GPz::GPz& gpz
         PARSE_OPTION(flux_column_prefix)
         PARSE_OPTION(error_column_prefix)
         PARSE_OPTION(use_errors)
-        PARSE_OPTION(output_min)
-        PARSE_OPTION(output_max)
+        PARSE_OPTION_RENAME(output_min_list, "output_min")
+        PARSE_OPTION_RENAME(output_max_list, "output_max")
         PARSE_OPTION(transform_inputs)
+        PARSE_OPTION(luptitude_f0)
+        PARSE_OPTION(train_max_rows)
+        PARSE_OPTION(train_max_rows_per_bin)
+        PARSE_OPTION(train_sample_seed)
+        PARSE_OPTION(row_filter)
+        PARSE_OPTION(row_range)
+        PARSE_OPTION(catalog_index)
+        PARSE_OPTION(training_cache)
+        PARSE_OPTION(index_stride)
+        PARSE_OPTION(specialist_models)
+        PARSE_OPTION(specialist_min_rows)
+        PARSE_OPTION(specialist_num_bf)
+        PARSE_OPTION(approx_prediction)
+        PARSE_OPTION(approx_tolerance)
+        PARSE_OPTION(approx_check_sample)
+        PARSE_OPTION_RENAME(output_quantities, "output_columns")
+        PARSE_OPTION(pdf_file)
+        PARSE_OPTION(pdf_format)
+        PARSE_OPTION(pdf_grid_min)
+        PARSE_OPTION(pdf_grid_max)
+        PARSE_OPTION(pdf_grid_step)
+        PARSE_OPTION(prediction_block_size)
+        PARSE_OPTION(resume_prediction)
+        PARSE_OPTION(output_compression)
+        PARSE_OPTION(prediction_cache)
+        PARSE_OPTION(model_cache_dir)
+        PARSE_OPTION(evaluate_catalog)
+        PARSE_OPTION(evaluate_validation)
+        PARSE_OPTION(evaluate_file)
+        PARSE_OPTION(evaluate_bin)
+        PARSE_OPTION(evaluate_outlier)
+        PARSE_OPTION_RENAME(evaluate_relative_list, "evaluate_relative")
+        PARSE_OPTION(profile_file)
+        if (key == "n_thread" && to_lower(val) == "auto") { opts.n_thread_auto = true; return true; }
+        PARSE_OPTION(n_thread)
         PARSE_OPTION_RENAME(bands_regex, "bands")
 
-        PARSE_OPTION_GPZ(verbose,                       bool,                                setVerboseMode)
-        PARSE_OPTION_GPZ(num_bf,                        uint_t,                              setNumberOfBasisFunctions)
-        PARSE_OPTION_GPZ(covariance,                    PHZ_GPz::CovarianceType,             setCovarianceType)
-        PARSE_OPTION_GPZ(prior_mean,                    PHZ_GPz::PriorMeanFunction,          setPriorMeanFunction)
-        PARSE_OPTION_GPZ(weighting_scheme,              PHZ_GPz::WeightingScheme,            setWeightingScheme)
-        PARSE_OPTION_GPZ(normalization_scheme,          PHZ_GPz::NormalizationScheme,        setNormalizationScheme)
-        PARSE_OPTION_GPZ(valid_sample_method,           PHZ_GPz::TrainValidationSplitMethod, setTrainValidationSplitMethod)
-        PARSE_OPTION_GPZ(output_error_type,             PHZ_GPz::OutputUncertaintyType,      setOutputUncertaintyType)
-        PARSE_OPTION_GPZ(balanced_weighting_bin,        double,                              setBalancedWeightingBinSize)
-        PARSE_OPTION_GPZ(balanced_weighting_max_weight, double,                              setBalancedWeightingMaxWeight)
-        PARSE_OPTION_GPZ(train_valid_ratio,             double,                              setTrainValidationRatio)
-        PARSE_OPTION_GPZ(valid_sample_seed,             uint_t,                              setTrainValidationSplitSeed)
-        PARSE_OPTION_GPZ(bf_position_seed,              uint_t,                              setInitialPositionSeed)
-        PARSE_OPTION_GPZ(fuzzing,                       bool,                                setFuzzInitialValues)
-        PARSE_OPTION_GPZ(fuzzing_seed,                  uint_t,                              setFuzzingSeed)
-        PARSE_OPTION_GPZ(max_iter,                      uint_t,                              setOptimizationMaxIterations)
-        PARSE_OPTION_GPZ(tolerance,                     double,                              setOptimizationTolerance)
-        PARSE_OPTION_GPZ(grad_tolerance,                double,                              setOptimizationGradientTolerance)
-        PARSE_OPTION_GPZ(predict_error,                 bool,                                setPredictVariance)
-
-        PARSE_OPTION_GPZ_OPTIM(n_thread, maxThreads)
+        PARSE_OPTION(verbose)
+        PARSE_OPTION(predict_error)
+        PARSE_OPTION(num_bf)
+        PARSE_OPTION(covariance)
+        PARSE_OPTION(prior_mean)
+        PARSE_OPTION(weighting_scheme)
+        PARSE_OPTION(normalization_scheme)
+        PARSE_OPTION(output_error_type)
+        PARSE_GPZ_OPTION(balanced_weighting_bin)
+        PARSE_GPZ_OPTION(balanced_weighting_max_weight)
+        PARSE_GPZ_OPTION(bf_position_seed)
+        PARSE_GPZ_OPTION(fuzzing)
+        PARSE_GPZ_OPTION(fuzzing_seed)
+        PARSE_GPZ_OPTION(max_iter)
+        PARSE_GPZ_OPTION(tolerance)
+        PARSE_GPZ_OPTION(grad_tolerance)
+        PARSE_GPZ_OPTION(train_valid_ratio)
+        PARSE_GPZ_OPTION(valid_sample_seed)
+        PARSE_GPZ_OPTION(valid_sample_method)
 
         #undef  PARSE_OPTION
         #undef  PARSE_OPTION_RENAME
-        #undef  PARSE_OPTION_GPZ
-        #undef  PARSE_OPTION_GPZ_OPTIM
+        #undef  PARSE_GPZ_OPTION
 
         unparsed_key.push_back(key);
         unparsed_val.push_back(val);
@@ -238,6 +279,11 @@ bool read_config(const std::string& filename, options_t& opts, PHZ_GPz::GPz& gpz
 
     // Check and adjust options
 
+    if (opts.n_thread_auto) {
+        detect_threads(opts);
+    }
+
+    optim.maxThreads = opts.n_thread;
     if (optim.maxThreads > 1) {
         optim.enableMultithreading = true;
     }
@@ -250,22 +296,57 @@ bool read_config(const std::string& filename, options_t& opts, PHZ_GPz::GPz& gpz
         opts.model_file = "gpz_model.dat";
     }
 
-    if (optim.maxThreads > 100) {
+    opts.output_columns = trim(split(remove_first_last(opts.output_column, "[]"), ","));
+    if (count(opts.output_columns == "") != 0) {
+        error("OUTPUT_COLUMN must contain one column name, or a comma-separated list of column names");
+        return false;
+    }
+
+    if (unique_values(to_lower(opts.output_columns)).size() != opts.output_columns.size()) {
+        error("the same column is listed twice in OUTPUT_COLUMN=", opts.output_column);
+        return false;
+    }
+
+    const uint_t nout = opts.output_columns.size();
+    if ((opts.output_min_list.size() > 1 && opts.output_min_list.size() != nout) ||
+        (opts.output_max_list.size() > 1 && opts.output_max_list.size() != nout)) {
+        error("OUTPUT_MIN and OUTPUT_MAX must contain either one value, or one value for each "
+            "column in OUTPUT_COLUMN (", nout, ")");
+        return false;
+    }
+
+    // Options of the first output, for code that only deals with one
+    opts.output_column = opts.output_columns[0];
+    if (!opts.output_min_list.empty()) opts.output_min = opts.output_min_list[0];
+    if (!opts.output_max_list.empty()) opts.output_max = opts.output_max_list[0];
+
+    if (!opts.n_thread_auto && optim.maxThreads > 100) {
         error("asking for more than 100 threads (", optim.maxThreads, ") is asking for trouble!");
         error("please double check the value of N_THREAD=...");
         return false;
     }
 
-    if (opts.training_catalog.empty() && !(opts.reuse_model && file::exists(opts.model_file))) {
+    bool has_models = opts.reuse_model;
+    for (uint_t i : range(nout)) {
+        has_models = has_models && file::exists(output_options(opts, i).model_file);
+    }
+
+    if (opts.specialist_models) {
+        has_models = has_models && file::exists(specialist_list_file(opts));
+    }
+
+    if (opts.training_catalog.empty() && !has_models) {
         error("GPz++ needs either a training catalog or a trained model before it can do predictions");
         error("please specify either TRAINING_CATALOG=...");
         error("... or set REUSE_MODEL=1 and provide a valid MODEL_FILE=...");
         return false;
     }
 
-    if (opts.training_catalog.empty() && opts.prediction_catalog.empty()) {
-        error("no training or prediction catalog provided, nothing to do");
-        error("please specify either TRAINING_CATALOG=... or PREDICTION_CATALOG=...");
+    if (opts.training_catalog.empty() && opts.prediction_catalog.empty() &&
+        opts.evaluate_catalog.empty()) {
+        error("no training, prediction or evaluation catalog provided, nothing to do");
+        error("please specify either TRAINING_CATALOG=..., PREDICTION_CATALOG=..., or "
+            "EVALUATE_CATALOG=...");
         return false;
     }
 
@@ -304,12 +385,233 @@ bool read_config(const std::string& filename, options_t& opts, PHZ_GPz::GPz& gpz
         return false;
     }
 
+    for (double f0 : opts.luptitude_f0) {
+        if (!is_finite(f0) || f0 <= 0.0) {
+            error("LUPTITUDE_F0 must be strictly positive (got ", f0, ")");
+            return false;
+        }
+    }
+
+    if (!opts.luptitude_f0.empty() && opts.transform_inputs != "flux_to_luptitude") {
+        error("LUPTITUDE_F0 can only be used with TRANSFORM_INPUTS=flux_to_luptitude");
+        return false;
+    }
+
+    if (opts.approx_prediction && !(opts.approx_tolerance > 0.0)) {
+        error("APPROX_TOLERANCE must be strictly positive (got ", opts.approx_tolerance, ")");
+        return false;
+    }
+
+    if (!opts.output_quantities.empty()) {
+        opts.output_quantities = to_lower(opts.output_quantities);
+        vec1s allowed_quantities = {"value", "uncertainty", "var.density", "var.tr.noise",
+            "var.in.noise"};
+        for (const std::string& q : opts.output_quantities) {
+            if (!is_any_of(q, allowed_quantities)) {
+                error("unknown output column '", q, "' in OUTPUT_COLUMNS");
+                note("must be one of ", collapse(allowed_quantities, ", "));
+                return false;
+            }
+        }
+
+        output_quantities_t& q = opts.quantities;
+        q.value           = is_any_of(std::string("value"),        opts.output_quantities);
+        q.uncertainty     = is_any_of(std::string("uncertainty"),  opts.output_quantities);
+        q.var_density     = is_any_of(std::string("var.density"),  opts.output_quantities);
+        q.var_train_noise = is_any_of(std::string("var.tr.noise"), opts.output_quantities);
+        q.var_input_noise = is_any_of(std::string("var.in.noise"), opts.output_quantities);
+
+        if (q.need_variance() && !opts.predict_error) {
+            error("OUTPUT_COLUMNS=", collapse(opts.output_quantities, ","), " requires predicting "
+                "uncertainties, please set PREDICT_ERROR=1");
+            return false;
+        }
+    }
+
+    if (!opts.pdf_file.empty()) {
+        opts.pdf_format = to_lower(opts.pdf_format);
+        vec1s allowed_formats = {"float32", "uint16", "uint8"};
+        if (!is_any_of(opts.pdf_format, allowed_formats)) {
+            error("unknown p(z) file format '", opts.pdf_format, "'");
+            note("must be one of ", collapse(allowed_formats, ", "));
+            return false;
+        }
+
+        if (!(opts.pdf_grid_step > 0.0) || !(opts.pdf_grid_max >= opts.pdf_grid_min)) {
+            error("the p(z) grid must have PDF_GRID_STEP > 0 and PDF_GRID_MAX >= PDF_GRID_MIN");
+            return false;
+        }
+
+        if (!opts.predict_error) {
+            error("writing the p(z) requires predicting uncertainties, please set PREDICT_ERROR=1");
+            return false;
+        }
+
+        if (!opts.quantities.uncertainty) {
+            error("writing the p(z) requires predicting uncertainties, please add 'uncertainty' "
+                "to OUTPUT_COLUMNS");
+            return false;
+        }
+
+        if (nout > 1) {
+            error("writing the p(z) is only supported for a single output, please set "
+                "PDF_FILE=\"\" or OUTPUT_COLUMN=<one column>");
+            return false;
+        }
+
+        if (opts.pdf_file == opts.output_catalog) {
+            error("the chosen p(z) file name (", opts.pdf_file, ") would overwrite the output catalog");
+            return false;
+        }
+    }
+
+    if (!opts.evaluate_catalog.empty() || opts.evaluate_validation) {
+        if (opts.evaluate_file.empty()) {
+            opts.evaluate_file = "gpz_eval.txt";
+        }
+
+        if (is_any_of(opts.evaluate_file, vec1s{opts.training_catalog, opts.prediction_catalog,
+            opts.evaluate_catalog, opts.output_catalog, opts.model_file})) {
+            error("the chosen evaluation file name (", opts.evaluate_file, ") would overwrite "
+                "another input or output file");
+            return false;
+        }
+
+        if (opts.evaluate_bin < 0.0 || !(opts.evaluate_outlier > 0.0)) {
+            error("EVALUATE_BIN must be positive or zero, and EVALUATE_OUTLIER strictly positive");
+            return false;
+        }
+
+        if (opts.evaluate_relative_list.size() > 1 &&
+            opts.evaluate_relative_list.size() != opts.output_columns.size()) {
+            error("EVALUATE_RELATIVE must contain either one value, or one value for each "
+                "column in OUTPUT_COLUMN (", opts.output_columns.size(), ")");
+            return false;
+        }
+
+        if (!opts.evaluate_relative_list.empty()) {
+            opts.evaluate_relative = opts.evaluate_relative_list[0] != 0;
+        }
+    }
+
+    if (!opts.row_range.empty() && (opts.row_range.size() != 2 || opts.row_range[0] > opts.row_range[1])) {
+        error("ROW_RANGE must contain two values [first, last], with first <= last");
+        return false;
+    }
+
+    if (opts.train_max_rows_per_bin > 0 && !(opts.balanced_weighting_bin > 0.0)) {
+        error("TRAIN_MAX_ROWS_PER_BIN requires BALANCED_WEIGHTING_BIN > 0");
+        return false;
+    }
+
+    if (opts.catalog_index && opts.index_stride == 0) {
+        error("INDEX_STRIDE must be strictly positive");
+        return false;
+    }
+
+    if (opts.specialist_models && opts.specialist_min_rows == 0) {
+        error("SPECIALIST_MIN_ROWS must be strictly positive");
+        return false;
+    }
+
+    if (!opts.prediction_cache.empty() && is_any_of(opts.prediction_cache, vec1s{
+        opts.training_catalog, opts.prediction_catalog, opts.output_catalog, opts.model_file,
+        opts.pdf_file})) {
+        error("the chosen prediction cache file name (", opts.prediction_cache, ") would "
+            "overwrite another input or output file");
+        return false;
+    }
+
+    if (!opts.prediction_cache.empty() && opts.transform_inputs == "flux_to_luptitude" &&
+        opts.luptitude_f0.empty()) {
+        error("PREDICTION_CACHE with TRANSFORM_INPUTS=flux_to_luptitude requires LUPTITUDE_F0");
+        note("otherwise the inputs depend on the softening of the whole prediction catalog, and "
+            "objects cannot be matched between catalogs (e.g., overlapping tiles)");
+        return false;
+    }
+
+    if (opts.resume_prediction && opts.prediction_block_size == 0) {
+        error("RESUME_PREDICTION=1 requires PREDICTION_BLOCK_SIZE > 0");
+        return false;
+    }
+
+    compression_t compression;
+    if (!parse_compression(opts.output_compression, compression)) {
+        error("unknown output compression '", opts.output_compression, "'");
+        note("allowed values: none, gzip, zstd");
+        return false;
+    }
+
+    if (!compression_supported(compression)) {
+        error("OUTPUT_COMPRESSION=", opts.output_compression, " is not supported by this build of GPz++");
+        note("GPz++ must be compiled with ", compression == compression_t::gzip ? "zlib" : "zstd");
+        return false;
+    }
+
+    // Set GPz options
+    gpz.setVerboseMode(opts.verbose);
+    gpz.setPredictVariance(opts.predict_error);
+    gpz.setNumberOfBasisFunctions(opts.num_bf);
+    gpz.setCovarianceType(opts.covariance);
+    gpz.setPriorMeanFunction(opts.prior_mean);
+    gpz.setWeightingScheme(opts.weighting_scheme);
+    gpz.setNormalizationScheme(opts.normalization_scheme);
+    gpz.setOutputUncertaintyType(opts.output_error_type);
+
+    // GPz options that GPz cannot report: only set if present in the parameter file
+    #define SET_GPZ_OPTION(name, setter) if (opts.gpz_option_set(#name)) { gpz.setter(opts.name); }
+
+    SET_GPZ_OPTION(balanced_weighting_bin,        setBalancedWeightingBinSize)
+    SET_GPZ_OPTION(balanced_weighting_max_weight, setBalancedWeightingMaxWeight)
+    SET_GPZ_OPTION(bf_position_seed,              setInitialPositionSeed)
+    SET_GPZ_OPTION(fuzzing,                       setFuzzInitialValues)
+    SET_GPZ_OPTION(fuzzing_seed,                  setFuzzingSeed)
+    SET_GPZ_OPTION(max_iter,                      setOptimizationMaxIterations)
+    SET_GPZ_OPTION(tolerance,                     setOptimizationTolerance)
+    SET_GPZ_OPTION(grad_tolerance,                setOptimizationGradientTolerance)
+    SET_GPZ_OPTION(train_valid_ratio,             setTrainValidationRatio)
+    SET_GPZ_OPTION(valid_sample_seed,             setTrainValidationSplitSeed)
+    SET_GPZ_OPTION(valid_sample_method,           setTrainValidationSplitMethod)
+
+    #undef SET_GPZ_OPTION
+
     // Set optimization parameters
     gpz.setOptimizationFlags(optim);
 
     return true;
 }
 
+// Options for one of the outputs listed in OUTPUT_COLUMN. With more than one output, each
+// output has its own model file, named after the output column.
+options_t output_options(const options_t& opts, uint_t i) {
+    options_t o = opts;
+    if (opts.output_columns.empty()) return o;
+
+    o.output_column = opts.output_columns[i];
+    if (!opts.output_min_list.empty()) {
+        o.output_min = opts.output_min_list[opts.output_min_list.size() == 1 ? 0 : i];
+    }
+    if (!opts.output_max_list.empty()) {
+        o.output_max = opts.output_max_list[opts.output_max_list.size() == 1 ? 0 : i];
+    }
+    if (!opts.evaluate_relative_list.empty()) {
+        o.evaluate_relative = opts.evaluate_relative_list[
+            opts.evaluate_relative_list.size() == 1 ? 0 : i] != 0;
+    }
+
+    if (opts.output_columns.size() > 1) {
+        auto add_suffix = [&](const std::string& filename) {
+            if (filename.empty()) return filename;
+            return file::remove_extension(filename)+"_"+o.output_column+
+                file::get_extension(filename);
+        };
+
+        o.model_file = add_suffix(opts.model_file);
+    }
+
+    return o;
+}
+
 template<typename T>
 bool read_vec1d(const std::string& line, T& v) {
     std::istringstream in(line);
@@ -324,7 +626,10 @@ bool read_vec1d(const std::string& line, T& v) {
 }
 
 bool read_model(options_t& opts, PHZ_GPz::GPzModel& model) {
-    std::string filename = opts.model_file;
+    return read_model(opts.model_file, opts, model);
+}
+
+bool read_model(const std::string& filename, options_t& opts, PHZ_GPz::GPzModel& model) {
     std::ifstream in(filename);
     if (!in) {
         error("could not open model file '", filename, "'");
@@ -504,7 +809,11 @@ bool read_model(options_t& opts, PHZ_GPz::GPzModel& model) {
 }
 
 bool read_header(const std::string& filename, vec1s& header) {
-    std::ifstream in(filename);
+    input_file_t in(filename);
+    if (!in.check()) {
+        return false;
+    }
+
     std::string line;
     while (ascii::getline(in, line)) {
         line = trim(line);
@@ -520,24 +829,150 @@ bool read_header(const std::string& filename, vec1s& header) {
         return true;
     }
 
+    if (!in.check()) {
+        return false;
+    }
+
     error("missing header in '", filename, "'");
     note("the header line must start with # and list the column names");
 
     return false;
 }
 
-bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz::Vec2d& input,
-    PHZ_GPz::Vec2d& inputError, PHZ_GPz::Vec1d& output, PHZ_GPz::Vec1d& weight,
-    const std::string& which) {
+namespace read_input_impl {
+    // Values entering the softening parameter f0 of the luptitudes: the flux uncertainties if
+    // USE_ERRORS=1, the positive fluxes otherwise. Other values are returned as NaN.
+    float luptitude_f0_value(const options_t& opts, float value) {
+        if (!is_finite(value) || value < 0.0 || (!opts.use_errors && value == 0.0)) {
+            return fnan;
+        }
+
+        return value;
+    }
+
+    // Read the values entering f0 from the columns cols of a row, and add them to values
+    bool read_luptitude_f0_values(const options_t& opts, const vec1s& spl, const vec1s& header,
+        const vec1u& cols, uint_t l, std::vector<vec1f>& values) {
+
+        for (uint_t i : range(cols)) {
+            float value;
+            if (!from_string(spl[cols[i]], value)) {
+                error("could not read feature (", header[cols[i]], ") from line ", l);
+                note("must be a floating point number, got: '", spl[cols[i]], "'");
+                return false;
+            }
+
+            value = luptitude_f0_value(opts, value);
+            if (is_finite(value)) {
+                values[i].push_back(value);
+            }
+        }
+
+        return true;
+    }
+
+    // Compute f0 for each feature over all the rows of a catalog, reading only the columns of
+    // col_f0. Values already stored in the catalog index are reused, new values are added to it.
+    bool catalog_luptitude_f0(const options_t& opts, const std::string& filename,
+        const vec1s& header, const vec1u& col_f0, catalog_index_t* index, vec1d& f0) {
+
+        const std::string rule = (opts.use_errors ? "error" : "flux");
+
+        f0 = replicate(dnan, col_f0.size());
+        vec1u missing;
+        for (uint_t i : range(col_f0)) {
+            std::string key = header[col_f0[i]]+" "+rule;
+            if (index && index->f0.count(key) != 0) {
+                f0[i] = index->f0[key];
+            } else {
+                missing.push_back(i);
+            }
+        }
+
+        if (missing.empty()) return true;
+
+        if (opts.verbose) {
+            note("computing the luptitude softening over all the rows of '", filename, "'");
+        }
+
+        vec1u cols = col_f0[missing];
+        std::vector<vec1f> values(missing.size());
+        input_file_t in(filename);
+        uint_t l = 0;
+        std::string line;
+        while (ascii::getline(in, line)) {
+            ++l;
+            line = trim(line);
+            if (line.empty() || line[0] == '#') continue;
+
+            vec1s spl = split_any_of(line, " \t\n\r");
+            if (spl.size() != header.size()) {
+                error("line ", l, " has ", spl.size(), " columns while header has ", header.size());
+                return false;
+            }
+
+            if (!read_luptitude_f0_values(opts, spl, header, cols, l, values)) {
+                return false;
+            }
+        }
+
+        if (!in.check()) {
+            return false;
+        }
+
+        for (uint_t m : range(missing)) {
+            f0[missing[m]] = inplace_median(values[m]);
+            if (index) {
+                index->f0[header[cols[m]]+" "+rule] = f0[missing[m]];
+            }
+        }
+
+        if (index) {
+            save_catalog_index(filename, *index);
+        }
+
+        return true;
+    }
+}
+
+// Read a catalog. If 'process' is set, the rows are read in blocks of 'block_size' rows: each
+// block is given to 'process' once read and transformed, and the arrays are reused for the next
+// block (on return, they hold the last block).
+bool read_ascii(options_t& opts, const std::string& filename, id_column_t& id, PHZ_GPz::Vec2d& input,
+    PHZ_GPz::Vec2d& inputError, PHZ_GPz::Vec2d& output, PHZ_GPz::Vec1d& weight,
+    const std::string& which, uint_t block_size = 0, const row_block_t& process = row_block_t()) {
 
     if (!file::exists(filename)) {
         error("could not open ", which, " catalog '", filename, "'");
         return false;
     }
 
-    // Read all lines to determine the number of elements
-    uint_t ngal = 0; {
-        std::ifstream in(filename);
+    // Read all lines to determine the number of elements, or use the index. A compressed catalog
+    // is not counted, since this would decompress it one more time: the arrays are then grown
+    // while reading, as with ROW_FILTER, and the number of rows is known at the end.
+    uint_t pid = profile_start("read_"+which+":count");
+    catalog_index_t index;
+    bool has_index = false;
+    bool compressed = detect_compression(filename) != compression_t::none;
+    if (opts.catalog_index) {
+        if (compressed) {
+            // Byte offsets are meaningless in a compressed file
+            if (opts.verbose) {
+                note("CATALOG_INDEX is not used for compressed catalog '", filename, "'");
+            }
+        } else {
+            has_index = get_catalog_index(filename, opts.index_stride, opts.verbose, index);
+        }
+    }
+
+    uint_t ngal = 0;
+    const bool counted = has_index || !compressed;
+    if (has_index) {
+        ngal = index.nrow;
+    } else if (!counted) {
+        ngal = npos;
+    } else {
+        input_file_t in(filename);
         std::string line;
         while (ascii::getline(in, line)) {
             line = trim(line);
@@ -545,33 +980,65 @@ bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz
 
             ++ngal;
         }
+
+        if (!in.check()) {
+            return false;
+        }
+    }
+
+    profile_stop(pid, counted ? ngal : 0);
+
+    // Only read a subset of the rows if asked (data rows counted from zero)
+    const uint_t nrow = ngal;
+    uint_t first_row = 0, last_row = ngal;
+    if (which == "prediction" && !opts.row_range.empty()) {
+        first_row = std::min(opts.row_range[0], ngal);
+        last_row = std::min(opts.row_range[1], ngal);
+        ngal = last_row - first_row;
     }
 
     // Read header to determine number of features and other content
     vec1s header;
-    if (!read_header(filename, header)) {
+    if (has_index && !index.header.empty()) {
+        header = index.header;
+    } else if (!read_header(filename, header)) {
         return false;
     }
 
+    const bool has_output = which == "training" || which == "evaluation";
+    vec1s output_columns = opts.output_columns;
+    if (output_columns.empty()) {
+        output_columns.push_back(opts.output_column);
+    }
+
+    const uint_t noutput = (has_output ? output_columns.size() : 0);
+
     uint_t col_id = npos;
-    uint_t col_output = npos;
     uint_t col_weight = npos;
+    vec1u col_output(noutput);
+    vec1d output_min(noutput), output_max(noutput);
     vec1u col_flux, col_eflux;
 
     vec1b column_used(header.size());
-    if (which == "training") {
-        col_output = where_first(header == to_lower(opts.output_column));
-        if (col_output == npos) {
-            error("could not find output column '", opts.output_column, "'");
-            error("in file '", filename, "'");
-            return false;
-        }
+    if (has_output) {
+        for (uint_t o : range(noutput)) {
+            col_output[o] = where_first(header == to_lower(output_columns[o]));
+            if (col_output[o] == npos) {
+                error("could not find output column '", output_columns[o], "'");
+                error("in file '", filename, "'");
+                return false;
+            }
 
-        column_used[col_output] = true;
+            column_used[col_output[o]] = true;
 
-        if (!opts.weight_column.empty()) {
+            options_t oopts = output_options(opts, o);
+            output_min[o] = oopts.output_min;
+            output_max[o] = oopts.output_max;
+        }
+
+        if (which == "training" && !opts.weight_column.empty()) {
             col_weight = where_first(header == to_lower(opts.weight_column));
-            if (col_output == npos) {
+            if (col_weight == npos) {
                 error("could not find weight column '", opts.weight_column, "'");
                 error("in file '", filename, "'");
                 return false;
@@ -634,6 +1101,9 @@ bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz
             if (which == "training") {
                 c1 = "stored model";
                 c2 = "training catalog";
+            } else if (which == "evaluation") {
+                c1 = "training catalog";
+                c2 = "evaluation catalog";
             } else {
                 c1 = "training catalog";
                 c2 = "prediction catalog";
@@ -649,34 +1119,148 @@ bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz
 
     uint_t nfeature = bands.size();
 
-    // Resize arrays
-    input.resize(ngal, nfeature);
-    if (opts.use_errors) {
-        inputError.resize(ngal, nfeature);
+    // Compile row filter (only applied to the prediction catalog)
+    row_filter_t filter;
+    if (which == "prediction" && !opts.row_filter.empty()) {
+        if (!filter.compile(opts.row_filter, header)) {
+            error("in file '", filename, "'");
+            return false;
+        }
     }
 
-    if (which == "training") {
-        output.resize(ngal);
-        if (col_weight != npos) {
-            weight.resize(ngal);
+    // With LUPTITUDE_F0, f0 of the luptitudes is fixed. Otherwise, with ROW_RANGE or ROW_FILTER,
+    // or when reading in blocks, it is computed over all the rows of the catalog, in a separate
+    // pass (and stored in the index), so that it does not depend on how the catalog is split
+    // between jobs, or on the filter
+    const bool luptitude = opts.transform_inputs == "flux_to_luptitude";
+    const bool blocks = static_cast<bool>(process);
+    const bool partial_rows = first_row > 0 || last_row < nrow || !filter.empty() || blocks;
+    vec1d f0_all;
+    if (luptitude && !opts.luptitude_f0.empty()) {
+        if (opts.luptitude_f0.size() == 1) {
+            f0_all = replicate(opts.luptitude_f0[0], nfeature);
+        } else if (opts.luptitude_f0.size() == nfeature) {
+            f0_all = opts.luptitude_f0;
+        } else {
+            error("LUPTITUDE_F0 must have one value, or one value per feature (", nfeature,
+                "), but has ", opts.luptitude_f0.size());
+            return false;
         }
+    } else if (luptitude && partial_rows) {
+        pid = profile_start("read_"+which+":softening");
+        const vec1u col_f0 = (opts.use_errors ? col_eflux : col_flux);
+        if (!read_input_impl::catalog_luptitude_f0(opts, filename, header, col_f0,
+            has_index ? &index : nullptr, f0_all)) {
+            error("in file '", filename, "'");
+            return false;
+        }
+
+        profile_stop(pid);
+    }
+
+    // Apply TRANSFORM_INPUTS to the first n rows of the arrays
+    auto transform_rows = [&](uint_t n) {
+        for (uint_t i : range(nfeature)) {
+            if (opts.transform_inputs == "flux_to_luptitude") {
+                double f0 = 0.0;
+                if (!f0_all.empty()) {
+                    f0 = f0_all[i];
+                } else if (opts.use_errors) {
+                    vec1d tmp(n);
+                    for (uint_t k : range(n)) tmp[k] = inputError(k,i);
+                    f0 = inplace_median(tmp);
+                } else {
+                    vec1d tmp(n);
+                    for (uint_t k : range(n)) tmp[k] = input(k,i);
+                    tmp = tmp[where(tmp > 0)];
+                    f0 = inplace_median(tmp);
+                }
+
+                for (uint_t k : range(n)) {
+                    input(k,i) /= 2.0*f0;
+                    if (opts.use_errors) {
+                        inputError(k,i) = (2.5/log(10.0))*inputError(k,i)
+                            /sqrt(1.0 + sqr(input(k,i)))/(2.0*f0);
+                    }
+                    input(k,i) = -(2.5/log(10.0))*(asinh(input(k,i)) + log(f0));
+                }
+            }
+        }
+    };
+
+    // Sample the training set if asked
+    row_sampler_t sampler(opts);
+    const bool sampling = which == "training" && sampler.enabled();
+
+    // Resize arrays
+    auto resize_arrays = [&](uint_t n) {
+        input.conservativeResize(n, nfeature);
+        if (opts.use_errors) {
+            inputError.conservativeResize(n, nfeature);
+        }
+
+        if (has_output) {
+            output.conservativeResize(n, noutput);
+            if (col_weight != npos) {
+                weight.conservativeResize(n);
+            }
+        }
+    };
+
+    if (blocks) {
+        resize_arrays(std::min(ngal, block_size));
+    } else if (sampling) {
+        // With a per-bin cap only, the size of the sample is not known in advance
+        resize_arrays(opts.train_max_rows > 0 ? std::min(ngal, opts.train_max_rows) :
+            std::min(ngal, uint_t(4096)));
+    } else if (!filter.empty() || !counted) {
+        // Same for the number of rows selected by ROW_FILTER, or in a compressed catalog
+        resize_arrays(std::min(ngal, uint_t(4096)));
     } else {
-        if (col_id != npos) {
-            id.resize(ngal);
+        resize_arrays(ngal);
+    }
+
+    if (!has_output) {
+        id.clear();
+        if (col_id != npos && filter.empty() && counted) {
+            id.reserve(ngal);
         }
     }
 
     // Read in data
+    pid = profile_start("read_"+which+":parse");
+
+    // Processing a block is not part of the parsing
+    auto process_block = [&](uint_t n) {
+        transform_rows(n);
+        profile_stop(pid);
+        bool ok = process(input, inputError, output);
+        profile_resume(pid);
+        return ok;
+    };
     uint_t gid = 0;
+    uint_t nvalid = 0;
     uint_t l = 0;
-    std::ifstream in(filename);
+    uint_t row = 0;
+    input_file_t in(filename);
+
+    if (has_index && first_row > 0 && first_row < last_row) {
+        // Jump to the closest indexed row
+        uint_t k = first_row/index.stride;
+        in.seekg(index.offset[k]);
+        row = k*index.stride;
+        l = index.line[k] - 1;
+    }
 
+    vec1d values(noutput);
     std::string line;
-    while (ascii::getline(in, line)) {
+    while (row < last_row && ascii::getline(in, line)) {
         ++l;
         line = trim(line);
         if (line.empty() || line[0] == '#') continue;
 
+        if (row++ < first_row) continue;
+
         vec1s spl = split_any_of(line, " \t\n\r");
 
         if (spl.size() != header.size()) {
@@ -684,9 +1268,62 @@ bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz
             return false;
         }
 
-        // Read ID
+        // Apply row filter before converting anything else
+        if (!filter.empty()) {
+            bool pass = false;
+            if (!filter.evaluate(spl, pass)) {
+                error("reading line ", l, " of '", filename, "'");
+                return false;
+            }
+
+            if (!pass) continue;
+        }
+
+        // Read outputs
+        bool has_value = false;
+        for (uint_t o : range(noutput)) {
+            double& value = values[o];
+            if (!from_string(spl[col_output[o]], value)) {
+                error("could not read output (", output_columns[o], ") from line ", l);
+                note("must be a floating point number, got: '", spl[col_output[o]], "'");
+                return false;
+            }
+
+            // Remove excluded values
+            if (value < output_min[o] || value > output_max[o]) {
+                value = dnan;
+            }
+
+            has_value = has_value || is_finite(value);
+        }
+
+        // Find where to store this row
+        uint_t dst = gid;
+        if (sampling) {
+            // Rows without output are useless for training
+            if (!has_value) continue;
+
+            ++nvalid;
+            dst = sampler.add(row - 1, values[0]);
+            if (dst == npos) continue;
+
+            if (dst >= uint_t(input.rows())) {
+                resize_arrays(std::min(ngal, 2*uint_t(input.rows())));
+            }
+        } else if (dst >= uint_t(input.rows())) {
+            resize_arrays(std::min(ngal, std::max(2*uint_t(input.rows()), uint_t(4096))));
+        }
+
+        for (uint_t o : range(noutput)) {
+            output(dst,o) = values[o];
+        }
+
+        // Read ID; without ID column, rows selected by ROW_FILTER are identified by their row
+        // number in the catalog (counted as for ROW_RANGE)
         if (col_id != npos) {
-            id[gid] = spl[col_id];
+            id.push_back(spl[col_id]);
+        } else if (!filter.empty()) {
+            id.push_back(to_string(row - 1));
         }
 
         // Read inputs
@@ -702,11 +1339,11 @@ bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz
         }
 
         for (uint_t k : range(nfeature)) {
-            input(gid,k) = flx[k];
+            input(dst,k) = flx[k];
 
             // Flag bad values
             if (!is_finite(flx[k])) {
-                input(gid,k) = fnan;
+                input(dst,k) = fnan;
             }
         }
 
@@ -724,33 +1361,19 @@ bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz
             }
 
             for (uint_t k : range(nfeature)) {
-                inputError(gid,k) = err[k];
+                inputError(dst,k) = err[k];
 
                 // Flag bad values
                 if (!is_finite(err[k]) || err[k] < 0.0) {
-                    input(gid,k) = fnan;
-                    inputError(gid,k) = fnan;
+                    input(dst,k) = fnan;
+                    inputError(dst,k) = fnan;
                 }
             }
         }
 
-        // Read output
-        if (col_output != npos) {
-            if (!from_string(spl[col_output], output[gid])) {
-                error("could not read output (", opts.output_column, ") from line ", l);
-                note("must be a floating point number, got: '", spl[col_output], "'");
-                return false;
-            }
-
-            // Remove excluded values
-            if (output[gid] < opts.output_min || output[gid] > opts.output_max) {
-                output[gid] = fnan;
-            }
-        }
-
         // Read weight
         if (col_weight != npos) {
-            if (!from_string(spl[col_weight], weight[gid])) {
+            if (!from_string(spl[col_weight], weight[dst])) {
                 error("could not read weight (", opts.weight_column, ") from line ", l);
                 note("must be a floating point number, got: '", spl[col_weight], "'");
                 return false;
@@ -758,33 +1381,65 @@ bool read_ascii(options_t& opts, const std::string& filename, vec1s& id, PHZ_GPz
         }
 
         ++gid;
+
+        if (blocks && gid == uint_t(input.rows())) {
+            // Block complete, process it and start the next one in the same arrays
+            if (!process_block(gid)) {
+                return false;
+            }
+
+            gid = 0;
+        }
     }
 
-    if (!opts.transform_inputs.empty()) {
-        for (uint_t i : range(nfeature)) {
-            if (opts.transform_inputs == "flux_to_luptitude") {
-                double f0 = 0.0;
-                if (opts.use_errors) {
-                    vec1d tmp(ngal);
-                    for (uint_t k : range(ngal)) tmp[k] = inputError(k,i);
-                    f0 = inplace_median(tmp);
-                } else {
-                    vec1d tmp(ngal);
-                    for (uint_t k : range(ngal)) tmp[k] = input(k,i);
-                    tmp = tmp[where(tmp > 0)];
-                    f0 = inplace_median(tmp);
-                }
+    if (!in.check()) {
+        return false;
+    }
 
-                for (uint_t k : range(ngal)) {
-                    input(k,i) /= 2.0*f0;
-                    if (opts.use_errors) {
-                        inputError(k,i) = (2.5/log(10.0))*inputError(k,i)
-                            /sqrt(1.0 + sqr(input(k,i)))/(2.0*f0);
-                    }
-                    input(k,i) = -(2.5/log(10.0))*(asinh(input(k,i)) + log(f0));
-                }
+    if (!counted) {
+        last_row = std::min(last_row, row);
+        ngal = (last_row > first_row ? last_row - first_row : 0);
+    }
+
+    if (blocks) {
+        if (gid != 0) {
+            resize_arrays(gid);
+            if (!process_block(gid)) {
+                return false;
             }
         }
+
+        profile_stop(pid, ngal);
+        return true;
+    }
+
+    profile_stop(pid, ngal);
+
+    if (sampling) {
+        vec1u slots = sampler.kept_slots();
+        input = extract_rows(input, slots);
+        inputError = extract_rows(inputError, slots);
+        output = extract_rows(output, slots);
+        weight = extract_rows(weight, slots);
+
+        if (opts.verbose) {
+            note("sampled ", slots.size(), " training rows out of ", nvalid, " with a valid output");
+        }
+
+        ngal = slots.size();
+    } else if (gid != uint_t(input.rows())) {
+        if (gid != ngal && opts.verbose) {
+            note("ROW_FILTER selected ", gid, " out of ", ngal, " rows");
+        }
+
+        ngal = gid;
+        resize_arrays(ngal);
+    }
+
+    if (!opts.transform_inputs.empty()) {
+        pid = profile_start("read_"+which+":transform");
+        transform_rows(ngal);
+        profile_stop(pid, ngal);
     }
 
     return true;
@@ -794,18 +1449,58 @@ bool read_training(options_t& opts,
     PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError,
     PHZ_GPz::Vec1d& output, PHZ_GPz::Vec1d& weight) {
 
-    vec1s id;
+    // Only read the first output
+    options_t oopts = output_options(opts, 0);
+    oopts.output_columns.clear();
+
+    PHZ_GPz::Vec2d outputs;
+    if (!read_training(oopts, input, inputError, outputs, weight)) {
+        return false;
+    }
+
+    opts.bands = oopts.bands;
+    output = outputs.col(0);
+
+    return true;
+}
+
+bool read_training(options_t& opts,
+    PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError,
+    PHZ_GPz::Vec2d& output, PHZ_GPz::Vec1d& weight) {
+
+    if (opts.training_cache && read_training_cache(opts, input, inputError, output, weight)) {
+        return true;
+    }
+
+    id_column_t id;
     if (!read_ascii(opts, opts.training_catalog, id, input, inputError, output, weight, "training")) {
         return false;
     }
 
+    if (opts.training_cache) {
+        write_training_cache(opts, input, inputError, output, weight);
+    }
+
+    return true;
+}
+
+bool read_evaluation(options_t& opts, uint_t block_size, const row_block_t& process) {
+    id_column_t id;
+    PHZ_GPz::Vec2d input, inputError, output;
+    PHZ_GPz::Vec1d weight;
+    if (!read_ascii(opts, opts.evaluate_catalog, id, input, inputError, output, weight,
+        "evaluation", block_size, process)) {
+        return false;
+    }
+
     return true;
 }
 
 bool read_prediction(options_t& opts,
-    vec1s& id, PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError) {
+    id_column_t& id, PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError) {
 
-    PHZ_GPz::Vec1d output, weight;
+    PHZ_GPz::Vec2d output;
+    PHZ_GPz::Vec1d weight;
     if (!read_ascii(opts, opts.prediction_catalog, id, input, inputError, output, weight, "prediction")) {
         return false;
     }
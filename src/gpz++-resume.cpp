@@ -0,0 +1,363 @@
+#include "gpz++.hpp"
+#include <unistd.h>
+
+// Block-wise prediction with resume
+// ---------------------------------
+//
+// With PREDICTION_BLOCK_SIZE > 0, the prediction catalog is processed in blocks of rows. The
+// output of each block is appended to the output catalog (and to the p(z) file, if any) and
+// flushed, then a small progress record is written next to the output catalog. The record
+// contains the number of rows done, the size of the output files at that point, and a key
+// identifying the inputs of the prediction (prediction catalog, models, and options that change
+// the output). The record is written to a temporary file first and then renamed, so it is
+// always consistent with the data it refers to.
+//
+// With RESUME_PREDICTION=1, the record is read back and, if the key matches, the output files
+// are truncated to the recorded size (removing any partially written block) and the prediction
+// continues from the first unfinished block.
+
+namespace resume_impl {
+    struct progress_t {
+        std::string key;
+        uint_t rows_total = 0;
+        uint_t rows_done = 0;
+        uint_t output_bytes = 0;
+        uint_t pdf_bytes = 0;
+    };
+
+    std::string progress_file(const options_t& opts) {
+        return opts.output_catalog+".progress";
+    }
+
+    std::string prediction_key(const options_t& opts, const std::vector<PHZ_GPz::GPz>& gpz,
+        const specialist_set_t& spec) {
+
+        std::uint64_t h = hash_seed;
+        h = hash_string(gpzpp_version, h);
+        h = file_signature(opts.prediction_catalog, h);
+        for (const auto& g : gpz) {
+            h = hash_model(g.getModel(), h);
+        }
+
+        for (uint_t s : range(spec.patterns)) {
+            h = hash_string(spec.patterns[s], h);
+            for (const auto& g : spec.gpz[s]) {
+                h = hash_model(g.getModel(), h);
+            }
+        }
+
+        // Options that change the content of the output files
+        std::ostringstream ss;
+        ss << std::setprecision(17) << opts.row_filter << '\n' << opts.transform_inputs << '\n'
+            << opts.use_errors << ' ' << opts.predict_error << ' ' << opts.approx_prediction << ' '
+            << opts.approx_tolerance << '\n' << opts.flux_column_prefix << '\n'
+            << opts.error_column_prefix << '\n' << collapse(opts.bands, ",") << '\n'
+            << (gpz.size() > 1 ? collapse(opts.output_columns, ",") : "") << '\n'
+            << opts.output_compression << ' ' << collapse(opts.output_quantities, ",") << '\n'
+            << opts.pdf_file << '\n' << opts.pdf_format << ' ' << opts.pdf_grid_min << ' '
+            << opts.pdf_grid_max << ' ' << opts.pdf_grid_step;
+
+        for (uint_t r : opts.row_range) {
+            ss << ' ' << r;
+        }
+
+        for (double f0 : opts.luptitude_f0) {
+            ss << ' ' << f0;
+        }
+
+        return hash_hex(hash_string(ss.str(), h));
+    }
+
+    bool read_progress(const std::string& filename, progress_t& p) {
+        std::ifstream in(filename);
+        if (!in) return false;
+
+        bool has_key = false;
+        std::string line;
+        while (ascii::getline(in, line)) {
+            line = trim(line);
+            if (line.empty() || line[0] == '#') continue;
+
+            auto sp = line.find_first_of(' ');
+            if (sp == line.npos) return false;
+
+            std::string key = line.substr(0, sp);
+            std::string val = trim(line.substr(sp+1));
+
+            bool ok = true;
+            if      (key == "key")          { p.key = val; has_key = true; }
+            else if (key == "rows_total")   ok = from_string(val, p.rows_total);
+            else if (key == "rows_done")    ok = from_string(val, p.rows_done);
+            else if (key == "output_bytes") ok = from_string(val, p.output_bytes);
+            else if (key == "pdf_bytes")    ok = from_string(val, p.pdf_bytes);
+
+            if (!ok) return false;
+        }
+
+        return has_key;
+    }
+
+    bool write_progress(const std::string& filename, const progress_t& p) {
+        std::string tmp = filename+".tmp";
+
+        {
+            std::ofstream fout(tmp);
+            fout << "# GPz++ prediction progress (do not edit)\n";
+            fout << "key " << p.key << "\n";
+            fout << "rows_total " << p.rows_total << "\n";
+            fout << "rows_done " << p.rows_done << "\n";
+            fout << "output_bytes " << p.output_bytes << "\n";
+            fout << "pdf_bytes " << p.pdf_bytes << "\n";
+            fout.close();
+
+            if (!fout) {
+                error("could not write progress file '", tmp, "'");
+                return false;
+            }
+        }
+
+        if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+            error("could not rename '", tmp, "' into '", filename, "'");
+            return false;
+        }
+
+        return true;
+    }
+
+    uint_t file_size(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (!in) return 0;
+        return in.tellg();
+    }
+
+    // Check if a previous run can be resumed, and prepare the output files if so
+    bool try_resume(const options_t& opts, const progress_t& current, progress_t& p) {
+        std::string filename = progress_file(opts);
+        if (!file::exists(filename)) {
+            if (opts.verbose) {
+                note("no progress file found ('", filename, "'), starting from the first row");
+            }
+
+            return false;
+        }
+
+        std::string reason;
+        if (!read_progress(filename, p)) {
+            reason = "the progress file '"+filename+"' could not be read";
+        } else if (p.key != current.key) {
+            reason = "the prediction catalog, the model, or the options have changed";
+        } else if (p.rows_total != current.rows_total || p.rows_done > p.rows_total) {
+            reason = "the number of rows has changed";
+        } else if (file_size(opts.output_catalog) < p.output_bytes) {
+            reason = "the output catalog is shorter than recorded";
+        } else if (!opts.pdf_file.empty() && file_size(opts.pdf_file) < p.pdf_bytes) {
+            reason = "the p(z) file is shorter than recorded";
+        }
+
+        if (reason.empty()) {
+            // Remove partially written blocks
+            if (truncate(opts.output_catalog.c_str(), p.output_bytes) != 0 ||
+                (!opts.pdf_file.empty() && truncate(opts.pdf_file.c_str(), p.pdf_bytes) != 0)) {
+                reason = "the output files could not be truncated";
+            }
+        }
+
+        if (!reason.empty()) {
+            warning("cannot resume previous prediction: ", reason);
+            warning("starting from the first row");
+            return false;
+        }
+
+        if (opts.verbose) {
+            note("resuming prediction at row ", p.rows_done, " of ", p.rows_total);
+        }
+
+        return true;
+    }
+}
+
+bool predict_catalog(const options_t& opts, std::vector<PHZ_GPz::GPz>& gpz,
+    specialist_set_t& spec, const id_column_t& id,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError) {
+
+    using namespace resume_impl;
+
+    const uint_t nrow = input.rows();
+    const bool blocked = opts.prediction_block_size > 0;
+    const uint_t block_size = (blocked ? opts.prediction_block_size : std::max(nrow, uint_t(1)));
+
+    progress_t progress;
+    if (blocked) {
+        progress.key = prediction_key(opts, gpz, spec);
+        progress.rows_total = nrow;
+    }
+
+    bool resumed = false;
+    if (blocked && opts.resume_prediction) {
+        progress_t previous;
+        if (try_resume(opts, progress, previous)) {
+            progress = previous;
+            resumed = true;
+        }
+    }
+
+    prediction_cache_t cache;
+    if (!cache.init(opts, gpz, spec, input.cols(), inputError.size() != 0)) {
+        return false;
+    }
+
+    // Open output files
+    compression_t compression;
+    parse_compression(opts.output_compression, compression);
+    output_file_t fout(opts.output_catalog, compression, resumed);
+    if (!fout) {
+        error("could not open output catalog '", opts.output_catalog, "' for writing");
+        return false;
+    }
+
+    std::ofstream fpdf;
+    if (!opts.pdf_file.empty()) {
+        fpdf.open(opts.pdf_file, std::ios::out | std::ios::binary |
+            (resumed ? std::ios::app : std::ios::trunc));
+        if (!fpdf) {
+            error("could not open p(z) file '", opts.pdf_file, "' for writing");
+            return false;
+        }
+    }
+
+    // Phases are accumulated over all blocks
+    uint_t pid_predict = profile_start("predict");
+    profile_stop(pid_predict);
+
+    uint_t pid_write = profile_start("write_output");
+    if (!resumed) {
+        write_output_header(fout, opts, gpz[0], id);
+    }
+    profile_stop(pid_write);
+
+    uint_t pid_pdf = npos;
+    if (!opts.pdf_file.empty()) {
+        pid_pdf = profile_start("write_pdf");
+        if (!resumed) {
+            write_pdf_header(fpdf, opts, nrow);
+        }
+        profile_stop(pid_pdf);
+    }
+
+    // State kept for each model across blocks (approximate prediction checks, ...)
+    prediction_context_t ctx;
+
+    vec1u nrouted(spec.empty() ? 0 : 1 + spec.patterns.size());
+    auto predict_rows = [&](const PHZ_GPz::Vec2d& pinput, const PHZ_GPz::Vec2d& pinputError,
+        std::vector<PHZ_GPz::GPzOutput>& out) {
+
+        // Route the rows to their model once, for all outputs
+        std::vector<vec1u> groups = spec.route(pinput);
+        for (uint_t g : range(groups.size())) {
+            nrouted[g] += groups[g].size();
+        }
+
+        for (uint_t m : range(gpz.size())) {
+            make_predictions(opts, gpz[m], spec, m, groups, pinput, pinputError, out[m], ctx);
+        }
+    };
+
+    uint_t first_row = progress.rows_done;
+    for (uint_t i0 = first_row; i0 < nrow; i0 += block_size) {
+        uint_t nblock = std::min(block_size, nrow - i0);
+
+        // Predict all outputs for this block
+        profile_resume(pid_predict);
+        PHZ_GPz::Vec2d binput, binputError;
+        if (blocked) {
+            binput = input.middleRows(i0, nblock);
+            if (inputError.size() != 0) {
+                binputError = inputError.middleRows(i0, nblock);
+            }
+        }
+
+        const PHZ_GPz::Vec2d& pinput = (blocked ? binput : input);
+        const PHZ_GPz::Vec2d& pinputError = (blocked ? binputError : inputError);
+
+        std::vector<PHZ_GPz::GPzOutput> out(gpz.size());
+        if (!cache.enabled) {
+            predict_rows(pinput, pinputError, out);
+        } else {
+            // Only predict the rows not found in the cache
+            vec1u miss = cache.lookup(pinput, pinputError, out);
+            if (miss.size() == nblock) {
+                predict_rows(pinput, pinputError, out);
+            } else if (!miss.empty()) {
+                std::vector<PHZ_GPz::GPzOutput> mout(gpz.size());
+                predict_rows(extract_rows(pinput, miss), extract_rows(pinputError, miss), mout);
+                for (uint_t m : range(gpz.size())) {
+                    copy_output_rows(mout[m], miss, nblock, out[m]);
+                }
+            }
+
+            cache.insert(pinput, pinputError, miss, out);
+        }
+
+        profile_stop(pid_predict, nblock);
+
+        // Write
+        profile_resume(pid_write);
+        write_output_rows(fout, opts, id, out, i0);
+        fout.end_block();
+        profile_stop(pid_write, nblock);
+
+        if (!opts.pdf_file.empty()) {
+            profile_resume(pid_pdf);
+            write_pdf_rows(fpdf, opts, out[0]);
+            fpdf.flush();
+            profile_stop(pid_pdf, nblock);
+        }
+
+        if (!fout || (!opts.pdf_file.empty() && !fpdf)) {
+            error("failed writing the output of rows ", i0, " to ", i0 + nblock);
+            return false;
+        }
+
+        if (blocked) {
+            progress.rows_done = i0 + nblock;
+            progress.output_bytes = fout.size();
+            if (!opts.pdf_file.empty()) {
+                progress.pdf_bytes = fpdf.tellp();
+            }
+
+            if (!write_progress(progress_file(opts), progress)) {
+                return false;
+            }
+
+            if (opts.verbose) {
+                note("predicted ", progress.rows_done, " of ", nrow, " rows");
+            }
+        }
+    }
+
+    ctx.report(opts);
+
+    if (cache.enabled && opts.verbose) {
+        note("found ", cache.nhit, " of ", cache.nlookup, " rows with identical inputs (after "
+            "TRANSFORM_INPUTS), models and options in the prediction cache '",
+            opts.prediction_cache, "' (hit rate: ", (cache.nlookup > 0 ?
+            round(1000.0*cache.nhit/cache.nlookup)/10.0 : 0.0), "%)");
+    }
+
+    if (!spec.empty() && opts.verbose) {
+        uint_t nspec = 0, nspec_rows = 0;
+        for (uint_t g = 1; g < nrouted.size(); ++g) {
+            nspec += (nrouted[g] != 0);
+            nspec_rows += nrouted[g];
+        }
+
+        note("predicted ", nspec_rows, " rows with ", nspec, " specialist model",
+            (nspec > 1 ? "s" : ""), ", and ", nrouted[0], " rows with the global model");
+    }
+
+    if (!opts.pdf_file.empty() && opts.verbose) {
+        note("wrote p(z) on ", pdf_grid_size(opts), " grid points in '", opts.pdf_file, "'");
+    }
+
+    return true;
+}
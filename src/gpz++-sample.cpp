@@ -0,0 +1,99 @@
+#include "gpz++.hpp"
+
+// Training set sampling
+// ---------------------
+//
+// Each row of the training catalog receives a pseudo-random key computed from its position in
+// the catalog and TRAIN_SAMPLE_SEED, and the sample is made of the rows with the smallest keys:
+// at most TRAIN_MAX_ROWS_PER_BIN in each bin of the output (of width BALANCED_WEIGHTING_BIN,
+// using the first output if there are several; rows where it is missing share one bin),
+// and at most TRAIN_MAX_ROWS in total. This is a reservoir sampling that can be done while
+// reading the catalog: a row that does not make it into the current sample is skipped before
+// its features are parsed, and the storage of a row that is pushed out of the sample is reused.
+// Since the keys only depend on the row position, the sample does not depend on the reading
+// order and is reproducible.
+
+namespace sample_impl {
+    std::uint64_t splitmix64(std::uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27))*0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+}
+
+row_sampler_t::row_sampler_t(const options_t& opts) :
+    max_rows(opts.train_max_rows), max_per_bin(opts.train_max_rows_per_bin),
+    bin_size(opts.balanced_weighting_bin), seed(opts.train_sample_seed) {}
+
+bool row_sampler_t::enabled() const {
+    return max_rows > 0 || max_per_bin > 0;
+}
+
+void row_sampler_t::remove(entry_t e) {
+    kept.erase(e);
+    if (max_per_bin > 0) {
+        bins[slot_bin[e.slot]].erase(e);
+    }
+
+    free_slots.push_back(e.slot);
+}
+
+uint_t row_sampler_t::add(uint_t row, double output) {
+    entry_t e;
+    e.key = sample_impl::splitmix64(seed*0x100000001b3ull ^ sample_impl::splitmix64(row));
+    e.row = row;
+
+    std::int64_t bin = 0;
+    if (max_per_bin > 0) {
+        bin = (is_finite(output) ? std::int64_t(floor(output/bin_size)) :
+            std::numeric_limits<std::int64_t>::min());
+        auto& b = bins[bin];
+        if (b.size() == max_per_bin) {
+            if (!(e < *b.rbegin())) return npos;
+            remove(*b.rbegin());
+        }
+    }
+
+    if (max_rows > 0 && kept.size() == max_rows) {
+        if (!(e < *kept.rbegin())) {
+            return npos;
+        }
+
+        remove(*kept.rbegin());
+    }
+
+    if (free_slots.empty()) {
+        e.slot = nslot++;
+        slot_bin.push_back(bin);
+    } else {
+        e.slot = free_slots.back();
+        free_slots.pop_back();
+        slot_bin[e.slot] = bin;
+    }
+
+    kept.insert(e);
+    if (max_per_bin > 0) {
+        bins[bin].insert(e);
+    }
+
+    return e.slot;
+}
+
+vec1u row_sampler_t::kept_slots() const {
+    // Sort by row, to keep the order of the catalog
+    std::vector<std::pair<uint_t,uint_t>> rows;
+    rows.reserve(kept.size());
+    for (const auto& e : kept) {
+        rows.push_back(std::make_pair(e.row, e.slot));
+    }
+
+    std::sort(rows.begin(), rows.end());
+
+    vec1u slots(rows.size());
+    for (uint_t i : range(rows.size())) {
+        slots[i] = rows[i].second;
+    }
+
+    return slots;
+}
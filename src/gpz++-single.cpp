@@ -0,0 +1,338 @@
+#include "gpz++.hpp"
+
+// Low-latency prediction of single objects
+// ----------------------------------------
+//
+// GPz::predict is designed for large arrays, and allocates its temporaries at each call; this
+// dominates the cost of predicting a single object. The single predictor evaluates the GPz
+// predictive equations directly, with factors cached from the model and buffers allocated once:
+//   phi_i = exp(-0.5*|G_i (x - P_i)|^2), with x the whitened features
+//   value = outputMean + sum_i w_i*phi_i
+//   var.density = phi^T S phi, with S = modelInvCovariance
+//   var.tr.noise = exp(logUncertaintyConstant + sum_i v_i*phi_i), or exp(logUncertaintyConstant)
+//                  if the output uncertainty is uniform
+// When all the G_i are diagonal, missing features are marginalized by leaving them out of the
+// sum in phi_i, and input uncertainties are handled by taking the expectation of the basis
+// functions over the Gaussian noise of the features, with Psi the whitened noise variance and
+// L_i = G_i^T G_i:
+//   E[phi_i] = |I + L_i Psi|^-1/2 exp(-0.5*(x - P_i)^T L_i (I + Psi L_i)^-1 (x - P_i))
+//   E[phi_i phi_j], the same for the product of two basis functions (a Gaussian of precision
+//                   L_i + L_j, times a constant)
+//   value = outputMean + sum_i w_i*E[phi_i]
+//   var.density = sum_ij S_ij*E[phi_i phi_j]
+//   var.in.noise = sum_ij w_i*w_j*E[phi_i phi_j] - (sum_i w_i*E[phi_i])^2
+//   var.tr.noise evaluated with E[phi]
+// This costs O(nbf^2*nfeat), but still needs no memory allocation. Since this is a
+// re-implementation, the result is compared to GPz::predict on a set of probe objects (without
+// and with uncertainties) when the predictor is built, and each case of the direct evaluation
+// is only used if they agree. Other objects (with input uncertainties or missing features if
+// this is not supported, or all objects if the check failed) are given to GPz::predict. Unlike
+// GPz::predict, the direct evaluation only computes the variance components needed for
+// 'quantities'.
+
+namespace single_impl {
+    bool same(double a, double b) {
+        return std::abs(a - b) <= 1e-6*(1.0 + std::abs(b));
+    }
+}
+
+single_predictor_t::single_predictor_t(const options_t& opts, PHZ_GPz::GPz& g) : gpz(g) {
+    using namespace single_impl;
+
+    const PHZ_GPz::GPzModel model = gpz.getModel();
+    const auto& par = model.parameters;
+
+    nbf = model.modelWeights.size();
+    nfeat = model.featureMean.size();
+    predict_error = opts.predict_error;
+    quantities = opts.quantities;
+    uniform_noise = gpz.getOutputUncertaintyType() == PHZ_GPz::OutputUncertaintyType::UNIFORM;
+    output_mean = model.outputMean;
+    log_noise = par.logUncertaintyConstant;
+
+    mean = model.featureMean;
+    inv_sigma = model.featureSigma.cwiseInverse();
+    weights = model.modelWeights;
+    noise_weights = par.uncertaintyBasisWeights;
+    weight_covariance = model.modelInvCovariance;
+    positions = par.basisFunctionPositions.transpose();
+    precision.assign(par.basisFunctionCovariances.begin(), par.basisFunctionCovariances.end());
+
+    diagonal = true;
+    diag_precision.resize(nfeat, nbf);
+    for (uint_t i : range(nbf)) {
+        for (uint_t k : range(nfeat))
+        for (uint_t l : range(nfeat)) {
+            if (k != l && precision[i](k,l) != 0.0) diagonal = false;
+        }
+
+        diag_precision.col(i) = precision[i].diagonal();
+    }
+
+    x.resize(nfeat);
+    psi.resize(nfeat);
+    dx.resize(nfeat);
+    y.resize(nfeat);
+    observed.assign(nfeat, true);
+    phi.resize(nbf);
+    tmp.resize(nbf);
+    in1.resize(1, nfeat);
+    err1.resize(1, nfeat);
+
+    if (nbf == 0 || nfeat == 0) return;
+
+    // Probe objects: points between pairs of basis functions, in feature space
+    const uint_t nprobe = std::min(nbf, uint_t(8));
+    PHZ_GPz::Vec2d probes(nprobe, nfeat);
+    for (uint_t p : range(nprobe)) {
+        for (uint_t k : range(nfeat)) {
+            double xw = 0.7*positions(k,p) + 0.3*positions(k,(p+1) % nbf);
+            probes(p,k) = mean[k] + xw*model.featureSigma[k];
+        }
+    }
+
+    // Enable the direct evaluation, and keep it only if it matches GPz
+    fast = true;
+    fast = check(probes, PHZ_GPz::Vec2d());
+
+    if (fast && diagonal) {
+        // Uncertainties of the order of the spread of the features
+        PHZ_GPz::Vec2d probe_errors(nprobe, nfeat);
+        for (uint_t p : range(nprobe))
+        for (uint_t k : range(nfeat)) {
+            probe_errors(p,k) = (0.1 + 0.2*((p + k) % 3))*model.featureSigma[k];
+        }
+
+        fast_noisy = true;
+        fast_noisy = check(probes, probe_errors);
+    }
+
+    if (fast && diagonal && nfeat > 1) {
+        for (uint_t p : range(nprobe)) {
+            probes(p,p % nfeat) = dnan;
+        }
+
+        fast_missing = true;
+        fast_missing = check(probes, PHZ_GPz::Vec2d());
+    }
+
+    if (opts.verbose) {
+        if (!fast) {
+            note("single-object predictor does not match GPz for this model, using GPz::predict");
+        } else {
+            if (!fast_noisy) {
+                note("single-object predictor will use GPz::predict for objects with input "
+                    "uncertainties");
+            }
+            if (!fast_missing) {
+                note("single-object predictor will use GPz::predict for objects with missing "
+                    "features");
+            }
+        }
+    }
+}
+
+bool single_predictor_t::check(const PHZ_GPz::Vec2d& probes, const PHZ_GPz::Vec2d& errors) {
+    using namespace single_impl;
+
+    PHZ_GPz::GPzOutput ref = gpz.predict(probes, errors);
+
+    const bool noisy = errors.size() != 0;
+    result_t r;
+    std::vector<double> flux(nfeat), err(nfeat);
+    for (uint_t p : range(probes.rows())) {
+        // Probes are stored column-major, so copy them first
+        for (uint_t k : range(nfeat)) {
+            flux[k] = probes(p,k);
+            if (noisy) err[k] = errors(p,k);
+        }
+
+        predict_one(flux.data(), noisy ? err.data() : nullptr, r);
+
+        if (!same(r.value, ref.value[p])) return false;
+
+        if (predict_error) {
+            if ((quantities.need_density() &&
+                    !same(r.variance_train_density, ref.varianceTrainDensity[p])) ||
+                (quantities.need_train_noise() &&
+                    !same(r.variance_train_noise, ref.varianceTrainNoise[p])) ||
+                (noisy && quantities.need_input_noise() &&
+                    !same(r.variance_input_noise, ref.varianceInputNoise[p]))) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool single_predictor_t::direct(const double* flux, const double* err) {
+    bool missing = false;
+    noisy = false;
+    for (uint_t k : range(nfeat)) {
+        // Same convention as when reading a catalog
+        observed[k] = is_finite(flux[k]) && (!err || (is_finite(err[k]) && err[k] >= 0.0));
+        if (!observed[k]) {
+            missing = true;
+        } else if (err && err[k] > 0.0) {
+            noisy = true;
+        }
+    }
+
+    return fast && (!noisy || fast_noisy) && (!missing || fast_missing);
+}
+
+void single_predictor_t::predict_one(const double* flux, const double* err, result_t& r) {
+    if (!direct(flux, err)) {
+        predict_gpz(flux, err, r);
+        return;
+    }
+
+    for (uint_t k : range(nfeat)) {
+        x[k] = (observed[k] ? (flux[k] - mean[k])*inv_sigma[k] : 0.0);
+    }
+
+    if (noisy) {
+        for (uint_t k : range(nfeat)) {
+            psi[k] = (observed[k] ? sqr(err[k]*inv_sigma[k]) : 0.0);
+        }
+
+        predict_noisy(r);
+        return;
+    }
+
+    // Basis functions
+    for (uint_t i : range(nbf)) {
+        double e = 0.0;
+        if (diagonal) {
+            for (uint_t k : range(nfeat)) {
+                if (observed[k]) e += sqr(diag_precision(k,i)*(x[k] - positions(k,i)));
+            }
+        } else {
+            dx = x - positions.col(i);
+            y.noalias() = precision[i]*dx;
+            e = y.squaredNorm();
+        }
+
+        phi[i] = std::exp(-0.5*e);
+    }
+
+    r.value = output_mean + phi.dot(weights);
+
+    if (predict_error) {
+        r.variance_train_density = dnan;
+        r.variance_train_noise = dnan;
+        r.variance_input_noise = (quantities.need_input_noise() ? 0.0 : dnan);
+        r.uncertainty = dnan;
+
+        if (quantities.need_density()) {
+            tmp.noalias() = weight_covariance*phi;
+            r.variance_train_density = phi.dot(tmp);
+        }
+        if (quantities.need_train_noise()) {
+            r.variance_train_noise = std::exp(log_noise +
+                (uniform_noise ? 0.0 : phi.dot(noise_weights)));
+        }
+        if (quantities.uncertainty) {
+            r.uncertainty = sqrt(r.variance_train_density + r.variance_train_noise);
+        }
+    } else {
+        r.variance_train_density = dnan;
+        r.variance_train_noise = dnan;
+        r.variance_input_noise = dnan;
+        r.uncertainty = dnan;
+    }
+}
+
+void single_predictor_t::predict_noisy(result_t& r) {
+    // Expected basis functions (only used with diagonal G_i)
+    for (uint_t i : range(nbf)) {
+        double e = 0.0, logdet = 0.0;
+        for (uint_t k : range(nfeat)) {
+            if (!observed[k]) continue;
+
+            const double a = sqr(diag_precision(k,i));
+            const double d = 1.0 + a*psi[k];
+            e += a*sqr(x[k] - positions(k,i))/d;
+            logdet += std::log(d);
+        }
+
+        phi[i] = std::exp(-0.5*(e + logdet));
+    }
+
+    const double mu = phi.dot(weights);
+    r.value = output_mean + mu;
+
+    r.variance_train_density = dnan;
+    r.variance_train_noise = dnan;
+    r.variance_input_noise = dnan;
+    r.uncertainty = dnan;
+
+    if (!predict_error) return;
+
+    const bool need_density = quantities.need_density();
+    const bool need_input_noise = quantities.need_input_noise();
+    if (need_density || need_input_noise) {
+        // Expected products of basis functions, accumulated without storing them
+        double density = 0.0, second = 0.0;
+        for (uint_t i : range(nbf))
+        for (uint_t j = 0; j <= i; ++j) {
+            double e = 0.0, logdet = 0.0;
+            for (uint_t k : range(nfeat)) {
+                if (!observed[k]) continue;
+
+                const double a = sqr(diag_precision(k,i));
+                const double b = sqr(diag_precision(k,j));
+                const double ab = a + b;
+                if (ab == 0.0) continue;
+
+                const double d = 1.0 + ab*psi[k];
+                const double c = (a*positions(k,i) + b*positions(k,j))/ab;
+                e += ab*sqr(x[k] - c)/d + (a*b/ab)*sqr(positions(k,i) - positions(k,j));
+                logdet += std::log(d);
+            }
+
+            const double m = (i == j ? 1.0 : 2.0)*std::exp(-0.5*(e + logdet));
+            density += weight_covariance(i,j)*m;
+            second += weights[i]*weights[j]*m;
+        }
+
+        if (need_density) {
+            r.variance_train_density = density;
+        }
+        if (need_input_noise) {
+            r.variance_input_noise = std::max(second - mu*mu, 0.0);
+        }
+    }
+
+    if (quantities.need_train_noise()) {
+        r.variance_train_noise = std::exp(log_noise +
+            (uniform_noise ? 0.0 : phi.dot(noise_weights)));
+    }
+    if (quantities.uncertainty) {
+        r.uncertainty = sqrt(r.variance_train_density + r.variance_train_noise +
+            r.variance_input_noise);
+    }
+}
+
+void single_predictor_t::predict_gpz(const double* flux, const double* err, result_t& r) {
+    for (uint_t k : range(nfeat)) {
+        in1(0,k) = (observed[k] ? flux[k] : dnan);
+        if (err) err1(0,k) = (observed[k] ? err[k] : dnan);
+    }
+
+    PHZ_GPz::GPzOutput out = gpz.predict(in1, err ? err1 : PHZ_GPz::Vec2d());
+
+    r.value = out.value[0];
+    if (predict_error) {
+        r.uncertainty = out.uncertainty[0];
+        r.variance_train_density = out.varianceTrainDensity[0];
+        r.variance_train_noise = out.varianceTrainNoise[0];
+        r.variance_input_noise = out.varianceInputNoise[0];
+    } else {
+        r.uncertainty = dnan;
+        r.variance_train_density = dnan;
+        r.variance_train_noise = dnan;
+        r.variance_input_noise = dnan;
+    }
+}
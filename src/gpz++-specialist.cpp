@@ -0,0 +1,343 @@
+#include "gpz++.hpp"
+
+// Specialist models
+// -----------------
+//
+// With SPECIALIST_MODELS=1, the training rows are grouped by their pattern of missing features
+// (features flagged as NaN when reading the catalog). For each pattern shared by at least
+// SPECIALIST_MIN_ROWS rows, a specialist model is trained on these rows only, using only the
+// observed features (and SPECIALIST_NUM_BF basis functions, if set). The specialists are
+// trained concurrently, like the models of several outputs. The global model is still trained
+// on all the rows, and is used for the rows with a rarer pattern.
+//
+// For the predictions, each row is routed to the specialist of its pattern if there is one,
+// and to the global model otherwise. All the rows of a model are then predicted together.
+//
+// Specialist models are saved next to MODEL_FILE, with the pattern in their name, and listed
+// in a file named after MODEL_FILE with '_specialists.txt'. With MODEL_CACHE_DIR, the list and
+// the models are stored in the cache instead, named after a hash of the training set and options
+// (see specialist_cache_file()). With REUSE_MODEL=1, they are loaded from this list if it exists
+// and the global models are not retrained.
+
+namespace specialist_impl {
+    vec1u observed_features(const std::string& pattern) {
+        vec1u f;
+        for (uint_t k : range(pattern.size())) {
+            if (pattern[k] == '1') f.push_back(k);
+        }
+
+        return f;
+    }
+
+    bool in_model_cache(const options_t& opts) {
+        return !opts.model_cache_dir.empty() && !opts.training_catalog.empty();
+    }
+
+    // File of the specialist model of one output (options 'o'), next to the list in the model
+    // cache, or next to the model file of that output otherwise
+    std::string model_file(const options_t& opts, const options_t& o, const std::string& pattern) {
+        if (in_model_cache(opts)) {
+            return file::remove_extension(specialist_list_file(opts))+
+                (opts.output_columns.size() > 1 ? "_"+o.output_column : "")+
+                "_pattern"+pattern+".dat";
+        }
+
+        return file::remove_extension(o.model_file)+"_pattern"+pattern+
+            file::get_extension(o.model_file);
+    }
+
+    std::string describe(const options_t& opts, const std::string& pattern) {
+        vec1s missing;
+        for (uint_t k : range(pattern.size())) {
+            if (pattern[k] == '1') continue;
+            missing.push_back(k < opts.bands.size() ? opts.bands[k] : to_string(k));
+        }
+
+        return missing.empty() ? "no missing feature" : "missing "+collapse(missing, ", ");
+    }
+}
+
+bool specialist_set_t::empty() const {
+    return patterns.empty();
+}
+
+void specialist_set_t::add(const std::string& pattern, uint_t nrow, uint_t nout,
+    const PHZ_GPz::GPz& base) {
+
+    lookup[pattern] = patterns.size();
+    patterns.push_back(pattern);
+    features.push_back(specialist_impl::observed_features(pattern));
+    ntrain.push_back(nrow);
+    gpz.emplace_back(nout, base);
+}
+
+std::vector<vec1u> specialist_set_t::route(const PHZ_GPz::Vec2d& input) const {
+    std::vector<vec1u> groups;
+    if (empty()) return groups;
+
+    groups.resize(1 + patterns.size());
+    for (uint_t i : range(input.rows())) {
+        auto iter = lookup.find(missing_pattern(input, i));
+        groups[iter == lookup.end() ? 0 : 1 + iter->second].push_back(i);
+    }
+
+    return groups;
+}
+
+std::string missing_pattern(const PHZ_GPz::Vec2d& input, uint_t row) {
+    std::string pattern(input.cols(), '1');
+    for (uint_t k : range(pattern.size())) {
+        if (!is_finite(input(row,k))) pattern[k] = '0';
+    }
+
+    return pattern;
+}
+
+std::string specialist_list_file(const options_t& opts) {
+    if (specialist_impl::in_model_cache(opts)) {
+        return specialist_cache_file(opts);
+    }
+
+    return file::remove_extension(opts.model_file)+"_specialists.txt";
+}
+
+bool train_specialists(const options_t& opts, const PHZ_GPz::GPz& base,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec2d& output, const PHZ_GPz::Vec1d& weight, specialist_set_t& spec) {
+
+    using namespace specialist_impl;
+
+    const uint_t nrow = input.rows();
+    const uint_t nout = output.cols();
+
+    // Group the training rows by pattern
+    std::map<std::string, vec1u> pattern_rows;
+    for (uint_t i : range(nrow)) {
+        pattern_rows[missing_pattern(input, i)].push_back(i);
+    }
+
+    // Keep the frequent patterns, most frequent first. A pattern shared by all the rows needs
+    // no specialist, and at least one feature must be observed.
+    using pattern_t = std::pair<std::string, const vec1u*>;
+    std::vector<pattern_t> frequent;
+    uint_t nrare = 0, nrare_rows = 0;
+    for (const auto& p : pattern_rows) {
+        if (p.second.size() >= opts.specialist_min_rows && p.second.size() < nrow &&
+            p.first.find('1') != p.first.npos) {
+            frequent.push_back(std::make_pair(p.first, &p.second));
+        } else {
+            ++nrare;
+            nrare_rows += p.second.size();
+        }
+    }
+
+    std::stable_sort(frequent.begin(), frequent.end(), [](const pattern_t& a, const pattern_t& b) {
+        return a.second->size() > b.second->size();
+    });
+
+    spec = specialist_set_t();
+    for (const auto& p : frequent) {
+        spec.add(p.first, p.second->size(), nout, base);
+    }
+
+    if (opts.verbose) {
+        note("found ", pattern_rows.size(), " pattern", (pattern_rows.size() > 1 ? "s" : ""),
+            " of missing features in the training set");
+        for (uint_t s : range(spec.patterns)) {
+            note("  ", describe(opts, spec.patterns[s]), ": ", spec.ntrain[s],
+                " rows, specialist model");
+        }
+        if (nrare != 0) {
+            note("  ", nrare, " other pattern", (nrare > 1 ? "s" : ""), ": ", nrare_rows,
+                " rows, global model");
+        }
+    }
+
+    if (spec.empty()) {
+        if (opts.verbose) {
+            note("no specialist model needed, all rows will use the global model");
+        }
+
+        return true;
+    }
+
+    // Train all the specialists of all the outputs concurrently
+    const uint_t njob = spec.patterns.size()*nout;
+
+    std::vector<options_t> oopts(nout);
+    for (uint_t m : range(nout)) {
+        oopts[m] = output_options(opts, m);
+        oopts[m].evaluate_validation = false;
+    }
+
+    if (opts.specialist_num_bf > 0) {
+        for (auto& models : spec.gpz)
+        for (auto& g : models) {
+            g.setNumberOfBasisFunctions(opts.specialist_num_bf);
+        }
+    }
+
+    // With N_THREAD=auto, the calibration was done for the global model; the specialists are
+    // fit on fewer rows and features, and with SPECIALIST_NUM_BF, so calibrate them again on
+    // the largest one
+    options_t topts = opts;
+    if (opts.n_thread_auto) {
+        const vec1u& rows = *frequent[0].second;
+        const vec1u& cols = spec.features[0];
+        PHZ_GPz::Vec1d ioutput = output.col(0);
+
+        topts.verbose = false;
+        calibrate_threads(topts, spec.gpz[0][0], extract_rows(input, rows, cols),
+            extract_rows(inputError, rows, cols), extract_rows(ioutput, rows),
+            extract_rows(weight, rows));
+    }
+
+    const thread_plan_t plan = plan_fits(topts, njob);
+    for (auto& models : spec.gpz)
+    for (auto& g : models) {
+        set_fit_threads(g, plan.nthread_fit);
+    }
+
+    if (opts.verbose) {
+        note("training ", njob, " specialist model", (njob > 1 ? "s" : ""), ", ", plan.nfit,
+            " at a time with ", plan.nthread_fit, " thread", (plan.nthread_fit > 1 ? "s" : ""),
+            " each", (plan.pin ? ", pinned to NUMA nodes" : ""));
+    }
+
+    std::vector<std::string> failure(njob);
+    run_concurrently(njob, plan.nfit, [&](uint_t k) {
+        const uint_t s = k/nout, m = k%nout;
+        const vec1u& rows = *frequent[s].second;
+        const vec1u& cols = spec.features[s];
+
+        PHZ_GPz::Vec1d ioutput = output.col(m);
+        try {
+            spec.gpz[s][m].fit(extract_rows(input, rows, cols),
+                extract_rows(inputError, rows, cols), extract_rows(ioutput, rows),
+                extract_rows(weight, rows), PHZ_GPz::GPzModel());
+        } catch (std::exception& e) {
+            failure[k] = e.what();
+        }
+    }, plan.pin ? [&](uint_t w) { pin_thread(opts, w, plan.nfit); } :
+        std::function<void(uint_t)>());
+
+    // Give all the threads back to each model, for the predictions
+    for (auto& models : spec.gpz)
+    for (auto& g : models) {
+        set_fit_threads(g, opts.n_thread);
+    }
+
+    for (uint_t k : range(njob)) {
+        const uint_t s = k/nout, m = k%nout;
+        std::string what = "the specialist model for rows with "+describe(opts, spec.patterns[s])+
+            (nout > 1 ? " and output '"+oopts[m].output_column+"'" : "");
+
+        if (!failure[k].empty()) {
+            error("an exception occured during the training of ", what);
+            error(failure[k]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool write_specialists(const options_t& opts, const specialist_set_t& spec) {
+    using namespace specialist_impl;
+
+    const uint_t nout = std::max(opts.output_columns.size(), uint_t(1));
+    std::string filename = specialist_list_file(opts);
+
+    if (in_model_cache(opts) && !file::mkdir(opts.model_cache_dir)) {
+        error("could not create model cache directory '", opts.model_cache_dir, "'");
+        return false;
+    }
+
+    // Write to a temporary file first, so an interrupted run cannot leave a truncated list
+    std::ofstream fout(filename+".tmp");
+    fout << "## GPz " << gpzpp_version << " specialist models\n";
+    fout << "# pattern of missing features (1: observed, 0: missing) for: "
+        << collapse(opts.bands, " ") << "\n";
+    fout << "# pattern, number of training rows, model file for each output\n";
+
+    for (uint_t s : range(spec.patterns)) {
+        fout << spec.patterns[s] << " " << spec.ntrain[s];
+        for (uint_t m : range(nout)) {
+            options_t o = output_options(opts, m);
+            o.bands = opts.bands[spec.features[s]];
+
+            std::string file = model_file(opts, o, spec.patterns[s]);
+            write_model(file, o, spec.gpz[s][m].getModel());
+            fout << " " << file;
+        }
+
+        fout << "\n";
+    }
+
+    fout.close();
+    if (!fout || std::rename((filename+".tmp").c_str(), filename.c_str()) != 0) {
+        error("could not write list of specialist models in '", filename, "'");
+        return false;
+    }
+
+    return true;
+}
+
+bool read_specialists(const options_t& opts, const PHZ_GPz::GPz& base, specialist_set_t& spec) {
+    const uint_t nout = std::max(opts.output_columns.size(), uint_t(1));
+    std::string filename = specialist_list_file(opts);
+
+    std::ifstream in(filename);
+    if (!in) {
+        error("could not open list of specialist models '", filename, "'");
+        return false;
+    }
+
+    spec = specialist_set_t();
+
+    uint_t l = 0;
+    std::string line;
+    while (ascii::getline(in, line)) {
+        ++l;
+
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+
+        vec1s spl = split_any_of(line, " \t");
+        uint_t nrow = 0;
+        if (spl.size() != 2 + nout || !from_string(spl[1], nrow) ||
+            spl[0].size() != opts.bands.size() || spl[0].find_first_not_of("01") != npos) {
+            error("could not read specialist model from '", line, "'");
+            error("reading ", filename, " on line ", l);
+            note("the list must match the features and the outputs of the global model");
+            return false;
+        }
+
+        spec.add(spl[0], nrow, nout, base);
+        const uint_t s = spec.patterns.size() - 1;
+        for (uint_t m : range(nout)) {
+            options_t o = opts;
+            PHZ_GPz::GPzModel model;
+            if (!read_model(spl[2+m], o, model)) {
+                return false;
+            }
+
+            vec1s bands = opts.bands[spec.features[s]];
+            if (o.bands.size() != bands.size() || count(o.bands != bands) != 0) {
+                error("the features of the specialist model '", spl[2+m], "' do not match "
+                    "its pattern in '", filename, "'");
+                return false;
+            }
+
+            spec.gpz[s][m].loadModel(model);
+        }
+    }
+
+    if (opts.verbose) {
+        const uint_t nmodel = spec.patterns.size()*nout;
+        note("loaded ", nmodel, " specialist model", (nmodel > 1 ? "s" : ""), " from '",
+            filename, "'");
+    }
+
+    return true;
+}
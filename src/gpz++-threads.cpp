@@ -0,0 +1,280 @@
+#include "gpz++.hpp"
+#include <thread>
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+// Automatic thread setup
+// ----------------------
+//
+// With N_THREAD=auto, GPz++ uses all the CPUs it is allowed to run on, and finds their NUMA
+// nodes (on Linux). Once the training set is read, a short calibration fits a sample of it
+// (with the actual NUM_BF and COVARIANCE) for a few iterations, with an increasing number of
+// threads given to the GPz library, and records the time taken. The cost of an iteration grows
+// with the number of basis functions, so the sample has calibration_rows rows for
+// calibration_num_bf basis functions, and proportionally fewer rows for more basis functions
+// (at least calibration_min_rows). The calibration stops as soon as adding threads no longer
+// makes the fit faster, or once it has taken more than calibration_budget seconds.
+//
+// When several independent models must be trained (several outputs, specialist models), the
+// measured times are used to choose how many fits run at the same time and how many threads
+// each one uses, minimizing the estimated total time. Specialist models are fit on fewer rows
+// and features and with SPECIALIST_NUM_BF, so they are calibrated again on the largest one
+// (see train_specialists()). If there are several NUMA nodes and each fit fits in one node,
+// each fit is pinned to a node, so that its threads and memory stay local. The parsing of the
+// catalogs is sequential (compressed catalogs are decompressed in one extra thread), so it
+// needs no threads of its own. Pinned fits are spread over the nodes in proportion to their
+// number of CPUs (see pin_thread()).
+
+namespace threads_impl {
+    const uint_t calibration_rows = 10000;
+    const uint_t calibration_num_bf = 100;
+    const uint_t calibration_min_rows = 1000;
+    const uint_t calibration_iter = 3;
+    const double calibration_budget = 30.0;
+
+    // Parse a Linux CPU list, e.g., "0-7,16-23"
+    vec1u parse_cpu_list(const std::string& str) {
+        vec1u cpus;
+        for (const std::string& item : split(trim(str), ",")) {
+            vec1s range_spl = split(item, "-");
+            uint_t c0 = 0, c1 = 0;
+            if (!from_string(range_spl[0], c0)) continue;
+            c1 = c0;
+            if (range_spl.size() == 2 && !from_string(range_spl[1], c1)) continue;
+            for (uint_t c = c0; c <= c1; ++c) {
+                cpus.push_back(c);
+            }
+        }
+
+        return cpus;
+    }
+
+    vec1u usable_cpus() {
+        vec1u cpus;
+    #ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (uint_t c = 0; c < CPU_SETSIZE; ++c) {
+                if (CPU_ISSET(c, &set)) cpus.push_back(c);
+            }
+        }
+    #endif
+
+        if (cpus.empty()) {
+            for (uint_t c : range(std::max(std::thread::hardware_concurrency(), 1u))) {
+                cpus.push_back(c);
+            }
+        }
+
+        return cpus;
+    }
+}
+
+void detect_threads(options_t& opts) {
+    using namespace threads_impl;
+
+    vec1u cpus = usable_cpus();
+    thread_setup_t& t = opts.threads;
+    t.numa_cpus.clear();
+
+#ifdef __linux__
+    for (uint_t n = 0;; ++n) {
+        std::string dir = "/sys/devices/system/node/node"+to_string(n);
+        std::ifstream in(dir+"/cpulist");
+        if (!in) break;
+
+        std::string line;
+        std::getline(in, line);
+
+        vec1u node;
+        for (uint_t c : parse_cpu_list(line)) {
+            if (is_any_of(c, cpus)) node.push_back(c);
+        }
+
+        if (!node.empty()) {
+            t.numa_cpus.push_back(node);
+        }
+    }
+#endif
+
+    if (t.numa_cpus.empty()) {
+        t.numa_cpus.push_back(cpus);
+    }
+
+    opts.n_thread = cpus.size();
+}
+
+void calibrate_threads(options_t& opts, const PHZ_GPz::GPz& base,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec1d& output, const PHZ_GPz::Vec1d& weight) {
+
+    using namespace threads_impl;
+
+    thread_setup_t& t = opts.threads;
+    t.calib_threads.clear();
+    t.calib_time.clear();
+
+    // Evenly spaced sample of the training set, smaller for larger models
+    const uint_t nrow = input.rows();
+    const uint_t nbf = std::max(uint_t(base.getNumberOfBasisFunctions()), uint_t(1));
+    const uint_t nsample = std::min(nrow, std::max(calibration_min_rows,
+        calibration_rows*calibration_num_bf/nbf));
+    vec1u rows;
+    for (uint_t i : range(nsample)) {
+        rows.push_back(i*nrow/nsample);
+    }
+
+    PHZ_GPz::Vec2d sinput = extract_rows(input, rows);
+    PHZ_GPz::Vec2d sinputError = extract_rows(inputError, rows);
+    PHZ_GPz::Vec1d soutput = extract_rows(output, rows);
+    PHZ_GPz::Vec1d sweight = extract_rows(weight, rows);
+
+    // Thread counts to try: powers of two, the size of a NUMA node, and all CPUs
+    vec1u candidates;
+    for (uint_t n = 1; n < opts.n_thread; n *= 2) {
+        candidates.push_back(n);
+    }
+
+    candidates.push_back(t.numa_cpus[0].size());
+    candidates.push_back(opts.n_thread);
+    candidates = unique_values(candidates);
+
+    double best = dinf;
+    double total = 0.0;
+    bool over_budget = false;
+    for (uint_t n : candidates) {
+        if (total > calibration_budget) {
+            over_budget = true;
+            break;
+        }
+
+        PHZ_GPz::GPz gpz = base;
+        gpz.setVerboseMode(false);
+        gpz.setOptimizationMaxIterations(calibration_iter);
+        set_fit_threads(gpz, n);
+
+        double t0 = now();
+        try {
+            gpz.fit(sinput, sinputError, soutput, sweight);
+        } catch (std::exception& e) {
+            warning("could not calibrate the number of threads: ", e.what());
+            break;
+        }
+
+        double dt = now() - t0;
+        total += dt;
+        t.calib_threads.push_back(n);
+        t.calib_time.push_back(dt);
+
+        // Stop once more threads do not help
+        if (dt > 1.1*best) break;
+        best = std::min(best, dt);
+    }
+
+    if (opts.verbose) {
+        vec1s nodes;
+        for (const vec1u& node : t.numa_cpus) {
+            nodes.push_back(to_string(node.size()));
+        }
+
+        note("N_THREAD=auto: ", opts.n_thread, " CPUs on ", t.numa_cpus.size(), " NUMA node",
+            (t.numa_cpus.size() > 1 ? "s ("+collapse(nodes, ", ")+" CPUs)" : ""));
+
+        vec1s timings;
+        for (uint_t i : range(t.calib_threads)) {
+            timings.push_back(to_string(t.calib_threads[i])+": "+
+                to_string(round(1000.0*t.calib_time[i]))+" ms");
+        }
+
+        note("calibration on ", nsample, " rows (", calibration_iter, " iterations, time per "
+            "number of threads): ", collapse(timings, ", "));
+        if (over_budget) {
+            note("calibration stopped after ", round(total), " seconds, larger numbers of "
+                "threads were not tried");
+        }
+
+        thread_plan_t plan = plan_fits(opts, 1);
+        note("a single fit will use ", plan.nthread_fit, " thread", (plan.nthread_fit > 1 ? "s" : ""),
+            (plan.nthread_fit < opts.n_thread ? " (more threads do not make it faster)" : ""),
+            ", parsing the catalogs uses one thread");
+    }
+}
+
+thread_plan_t plan_fits(const options_t& opts, uint_t njob) {
+    const thread_setup_t& t = opts.threads;
+    const uint_t nthread = std::max(opts.n_thread, uint_t(1));
+    njob = std::max(njob, uint_t(1));
+
+    thread_plan_t plan;
+    if (t.calib_threads.empty()) {
+        // Share the threads evenly between the fits
+        plan.nfit = std::min(njob, nthread);
+        plan.nthread_fit = std::max(nthread/plan.nfit, uint_t(1));
+        return plan;
+    }
+
+    // Minimize the estimated total time, among the calibrated thread counts
+    double best = dinf;
+    for (uint_t i : range(t.calib_threads)) {
+        uint_t n = t.calib_threads[i];
+        uint_t nfit = std::max(std::min(njob, nthread/n), uint_t(1));
+        double total = ((njob + nfit - 1)/nfit)*t.calib_time[i];
+        if (total < best) {
+            best = total;
+            plan.nfit = nfit;
+            plan.nthread_fit = n;
+        }
+    }
+
+    // Pin each fit to a NUMA node if it fits in one
+    uint_t node_size = t.numa_cpus[0].size();
+    for (const vec1u& node : t.numa_cpus) {
+        node_size = std::min(node_size, node.size());
+    }
+
+    plan.pin = t.numa_cpus.size() > 1 && plan.nfit > 1 && plan.nthread_fit <= node_size;
+
+    return plan;
+}
+
+namespace threads_impl {
+    // Node of a worker among nworker: the workers are spread over the nodes in proportion to
+    // their number of CPUs, each node getting the workers whose slot centre falls in its share
+    // of the CPUs
+    uint_t worker_node(const std::vector<vec1u>& nodes, uint_t worker, uint_t nworker) {
+        uint_t ncpu = 0;
+        for (const vec1u& node : nodes) {
+            ncpu += node.size();
+        }
+
+        nworker = std::max(nworker, uint_t(1));
+        const double pos = ((worker % nworker) + 0.5)*ncpu/nworker;
+        uint_t cumul = 0;
+        for (uint_t n : range(nodes.size())) {
+            cumul += nodes[n].size();
+            if (pos < cumul) return n;
+        }
+
+        return nodes.size() - 1;
+    }
+}
+
+bool pin_thread(const options_t& opts, uint_t worker, uint_t nworker) {
+#ifdef __linux__
+    const std::vector<vec1u>& nodes = opts.threads.numa_cpus;
+    if (nodes.empty()) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint_t c : nodes[threads_impl::worker_node(nodes, worker, nworker)]) {
+        CPU_SET(c, &set);
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
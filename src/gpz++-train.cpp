@@ -0,0 +1,163 @@
+#include "gpz++.hpp"
+#include <random>
+#include <numeric>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+// Train/validation split
+// ----------------------
+//
+// The GPz library splits the rows given to GPz::fit() into a training and a validation set,
+// but does not expose this split. It is reproduced here, following the same steps as the
+// library: row indices are shuffled with std::mt19937 seeded with VALID_SAMPLE_SEED (unless
+// VALID_SAMPLE_METHOD=sequential), and the first round(TRAIN_VALID_RATIO*nrow) rows are used
+// for training. Since this may go out of sync with the library, check_split() verifies it
+// against the trained model, and the split must not be used if the check fails.
+void split_training(const options_t& opts, uint_t nrow, vec1u& train, vec1u& valid) {
+    std::vector<uint_t> rows(nrow);
+    std::iota(rows.begin(), rows.end(), uint_t(0));
+
+    if (opts.valid_sample_method == PHZ_GPz::TrainValidationSplitMethod::RANDOM) {
+        std::mt19937 seed(opts.valid_sample_seed);
+        std::shuffle(rows.begin(), rows.end(), seed);
+    }
+
+    uint_t ntrain = std::min(nrow, uint_t(round(opts.train_valid_ratio*nrow)));
+    train.data.assign(rows.begin(), rows.begin() + ntrain);
+    valid.data.assign(rows.begin() + ntrain, rows.end());
+    inplace_sort(train);
+    inplace_sort(valid);
+}
+
+// With NORMALIZATION_SCHEME=whiten, the library whitens the features with their mean and
+// standard deviation over its training rows, and stores them in the model. Check that the mean
+// of each feature over the training rows of split_training() is the same. This cannot be
+// checked with other normalization schemes.
+bool check_split(const PHZ_GPz::GPz& gpz, const PHZ_GPz::Vec2d& input, const vec1u& train) {
+    if (gpz.getNormalizationScheme() != PHZ_GPz::NormalizationScheme::WHITEN) {
+        return false;
+    }
+
+    const PHZ_GPz::GPzModel model = gpz.getModel();
+    if (uint_t(model.featureMean.size()) != uint_t(input.cols())) {
+        return false;
+    }
+
+    for (uint_t k : range(input.cols())) {
+        double sum = 0.0;
+        uint_t n = 0;
+        for (uint_t i : train) {
+            if (is_finite(input(i,k))) {
+                sum += input(i,k);
+                ++n;
+            }
+        }
+
+        if (n == 0) continue;
+
+        const double mean = sum/n;
+        if (!(std::abs(mean - model.featureMean[k]) <= 1e-9*(std::abs(mean) + model.featureSigma[k]))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Concurrent fits
+// ---------------
+//
+// Independent fits are run concurrently by a pool of worker threads. Each fit is given its
+// share of N_THREAD with set_fit_threads(), following plan_fits().
+void set_fit_threads(PHZ_GPz::GPz& gpz, uint_t nthread) {
+    PHZ_GPz::GPzOptimizations optim;
+    optim.maxThreads = nthread;
+    optim.enableMultithreading = nthread > 1;
+    gpz.setOptimizationFlags(optim);
+}
+
+void run_concurrently(uint_t njob, uint_t nworker, const std::function<void(uint_t)>& job,
+    const std::function<void(uint_t)>& start) {
+
+    std::atomic<uint_t> next(0);
+    auto worker = [&](uint_t w) {
+        if (start) start(w);
+
+        uint_t k;
+        while ((k = next++) < njob) {
+            job(k);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (uint_t t = (start ? 0 : 1); t < nworker; ++t) {
+        threads.emplace_back(worker, t);
+    }
+
+    if (!start) worker(0);
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+// Training of several outputs
+// ---------------------------
+//
+// With several columns in OUTPUT_COLUMN, one model is trained for each output, on the same
+// inputs. The fits are independent and run concurrently: N_THREAD is split between at most
+// N_THREAD fits running at the same time, each fit using its share of the threads internally.
+// Only the models flagged in 'train' are trained.
+bool train_models(const std::vector<options_t>& opts, std::vector<PHZ_GPz::GPz>& gpz,
+    const vec1b& train, const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec2d& output, const PHZ_GPz::Vec1d& weight,
+    const std::vector<PHZ_GPz::GPzModel>& hint) {
+
+    vec1u ids = where(train);
+    if (ids.empty()) return true;
+
+    if (ids.size() == 1 && !opts[0].n_thread_auto) {
+        uint_t i = ids[0];
+        gpz[i].fit(input, inputError, output.col(i), weight, hint[i]);
+        return true;
+    }
+
+    const thread_plan_t plan = plan_fits(opts[0], ids.size());
+    for (uint_t i : ids) {
+        set_fit_threads(gpz[i], plan.nthread_fit);
+    }
+
+    if (opts[0].verbose && ids.size() > 1) {
+        note("training ", ids.size(), " models, ", plan.nfit, " at a time with ",
+            plan.nthread_fit, " thread", (plan.nthread_fit > 1 ? "s" : ""), " each",
+            (plan.pin ? ", pinned to NUMA nodes" : ""));
+    }
+
+    std::vector<std::string> failure(ids.size());
+    run_concurrently(ids.size(), plan.nfit, [&](uint_t k) {
+        uint_t i = ids[k];
+        try {
+            gpz[i].fit(input, inputError, output.col(i), weight, hint[i]);
+        } catch (std::exception& e) {
+            failure[k] = e.what();
+        }
+    }, plan.pin ? [&](uint_t w) { pin_thread(opts[0], w, plan.nfit); } :
+        std::function<void(uint_t)>());
+
+    // Give all the threads back to each model, for the predictions
+    for (uint_t i : ids) {
+        set_fit_threads(gpz[i], opts[i].n_thread);
+    }
+
+    for (uint_t k : range(ids)) {
+        if (!failure[k].empty()) {
+            error("an exception occured during the training of the model for '",
+                opts[ids[k]].output_column, "'");
+            error(failure[k]);
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,212 @@
+#include "gpz++.hpp"
+#include <Eigen/Core>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+// Cache of the training arrays
+// ----------------------------
+//
+// With TRAINING_CACHE=1, the arrays obtained after reading the training catalog (features,
+// their uncertainties, outputs and weights, after selection, sampling and TRANSFORM_INPUTS) are
+// saved in a binary file next to the catalog, with the extension '.gpzcache' added, together
+// with the resolved list of bands. The file starts with a key built from the signature of the
+// catalog (size and modification time) and from all the options that change the content of
+// these arrays, shared with the model cache (see training_data_key()). On the next run, if the
+// key matches, the file is mapped in memory and the arrays are copied out of it directly,
+// skipping the parsing. A cache whose key does not match is overwritten.
+//
+// File layout (native byte order): header_t, band names joined by '\n' and padded to a
+// multiple of 8 bytes, then the arrays as raw doubles in Eigen storage order: input,
+// inputError (if any), output, weight (if any).
+
+namespace training_cache_impl {
+    const char magic[8] = {'G', 'P', 'Z', 'C', 'A', 'C', 'H', 'E'};
+    const std::uint32_t format_version = 1;
+
+    struct header_t {
+        char magic[8];
+        std::uint32_t version = format_version;
+        std::uint32_t flags = 0;
+        std::uint64_t key = 0;
+        std::uint64_t nrow = 0, nfeature = 0, noutput = 0;
+        std::uint64_t bands_size = 0; // bytes of band names, including padding
+    };
+
+    enum : std::uint32_t {
+        has_error = 1, has_weight = 2
+    };
+
+    std::string cache_file(const std::string& catalog) {
+        return catalog+".gpzcache";
+    }
+
+    uint_t padded(uint_t n) {
+        return (n + 7)/8*8;
+    }
+
+    // Mapping of a whole file in memory, read only
+    struct mapped_file_t {
+        const char* data = nullptr;
+        std::size_t size = 0;
+
+        explicit mapped_file_t(const std::string& filename) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return;
+
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = static_cast<const char*>(p);
+                    size = st.st_size;
+                }
+            }
+
+            close(fd);
+        }
+
+        ~mapped_file_t() {
+            if (data) munmap(const_cast<char*>(data), size);
+        }
+
+        mapped_file_t(const mapped_file_t&) = delete;
+        mapped_file_t& operator=(const mapped_file_t&) = delete;
+    };
+
+    template<typename T>
+    void write_array(std::ofstream& fout, const T& a) {
+        fout.write(reinterpret_cast<const char*>(a.data()), a.size()*sizeof(double));
+    }
+}
+
+bool read_training_cache(options_t& opts, PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError,
+    PHZ_GPz::Vec2d& output, PHZ_GPz::Vec1d& weight) {
+
+    using namespace training_cache_impl;
+
+    std::string filename = cache_file(opts.training_catalog);
+    if (!file::exists(filename)) {
+        return false;
+    }
+
+    mapped_file_t map(filename);
+    header_t hdr;
+    if (map.size < sizeof(header_t)) {
+        return false;
+    }
+
+    std::memcpy(&hdr, map.data, sizeof(header_t));
+    if (std::memcmp(hdr.magic, magic, sizeof(magic)) != 0 || hdr.version != format_version ||
+        hdr.key != training_data_key(opts)) {
+        if (opts.verbose) {
+            note("training cache '", filename, "' is out of date, reading the catalog");
+        }
+
+        return false;
+    }
+
+    const uint_t nrow = hdr.nrow, nfeature = hdr.nfeature, noutput = hdr.noutput;
+    const bool errors = hdr.flags & has_error;
+    const bool weighted = hdr.flags & has_weight;
+    const uint_t ncol = nfeature*(errors ? 2 : 1) + noutput + (weighted ? 1 : 0);
+    if (map.size != sizeof(header_t) + hdr.bands_size + nrow*ncol*sizeof(double)) {
+        warning("training cache '", filename, "' is corrupted, reading the catalog");
+        return false;
+    }
+
+    const char* p = map.data + sizeof(header_t);
+    vec1s bands = split(std::string(p, strnlen(p, hdr.bands_size)), "\n");
+    if (bands.size() != nfeature) {
+        warning("training cache '", filename, "' is corrupted, reading the catalog");
+        return false;
+    }
+
+    if (!opts.bands.empty() && (opts.bands.size() != bands.size() || count(opts.bands != bands) > 0)) {
+        // Let the catalog reader report the mismatch
+        return false;
+    }
+
+    p += hdr.bands_size;
+
+    uint_t pid = profile_start("read_training:cache");
+
+    const double* d = reinterpret_cast<const double*>(p);
+    input = Eigen::Map<const PHZ_GPz::Vec2d>(d, nrow, nfeature);
+    d += nrow*nfeature;
+
+    inputError.resize(0, 0);
+    if (errors) {
+        inputError = Eigen::Map<const PHZ_GPz::Vec2d>(d, nrow, nfeature);
+        d += nrow*nfeature;
+    }
+
+    output = Eigen::Map<const PHZ_GPz::Vec2d>(d, nrow, noutput);
+    d += nrow*noutput;
+
+    weight.resize(0);
+    if (weighted) {
+        weight = Eigen::Map<const PHZ_GPz::Vec1d>(d, nrow);
+    }
+
+    opts.bands = bands;
+
+    profile_stop(pid, nrow);
+
+    if (opts.verbose) {
+        note("read ", nrow, " training rows from cache '", filename, "'");
+    }
+
+    return true;
+}
+
+void write_training_cache(const options_t& opts, const PHZ_GPz::Vec2d& input,
+    const PHZ_GPz::Vec2d& inputError, const PHZ_GPz::Vec2d& output, const PHZ_GPz::Vec1d& weight) {
+
+    using namespace training_cache_impl;
+
+    std::string filename = cache_file(opts.training_catalog);
+    std::string tmp = filename+".tmp";
+
+    std::string bands = collapse(opts.bands, "\n");
+
+    header_t hdr;
+    std::memcpy(hdr.magic, magic, sizeof(magic));
+    hdr.key = training_data_key(opts);
+    hdr.nrow = input.rows();
+    hdr.nfeature = input.cols();
+    hdr.noutput = output.cols();
+    hdr.bands_size = padded(bands.size() + 1);
+    if (inputError.size() != 0) hdr.flags |= has_error;
+    if (weight.size() != 0)     hdr.flags |= has_weight;
+
+    {
+        std::ofstream fout(tmp, std::ios::binary);
+        fout.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        bands.resize(hdr.bands_size, '\0');
+        fout.write(bands.data(), bands.size());
+
+        write_array(fout, input);
+        if (inputError.size() != 0) write_array(fout, inputError);
+        write_array(fout, output);
+        if (weight.size() != 0) write_array(fout, weight);
+
+        fout.close();
+        if (!fout) {
+            warning("could not save training cache in '", filename, "'");
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+        warning("could not save training cache in '", filename, "'");
+        return;
+    }
+
+    if (opts.verbose) {
+        note("saved training arrays in cache '", filename, "'");
+    }
+}
@@ -0,0 +1,8 @@
+#include "gpz++.hpp"
+
+#ifndef GPZPP_GIT_HASH
+#define GPZPP_GIT_HASH ""
+#endif
+
+const char* gpzpp_version = "1.0.0";
+const char* gpzpp_git_hash = GPZPP_GIT_HASH;
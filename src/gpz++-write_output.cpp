@@ -1,4 +1,5 @@
 #include "gpz++.hpp"
+#include <limits>
 
 template<typename T>
 void write_vec1d(std::ofstream& fout, const T& vec) {
@@ -22,7 +23,17 @@ void write_vec2d(std::ofstream& fout, const PHZ_GPz::Vec2d& vec) {
 }
 
 void write_model(const options_t& opts, const PHZ_GPz::GPzModel& model) {
-    std::ofstream fout(opts.model_file);
+    write_model(opts.model_file, opts, model);
+}
+
+void write_model(const std::string& filename, const options_t& opts,
+    const PHZ_GPz::GPzModel& model) {
+
+    std::ofstream fout(filename);
+
+    // Write all the digits, so that a model read back from this file is identical to the one in
+    // memory (same predictions, and same hash for RESUME_PREDICTION and PREDICTION_CACHE)
+    fout << std::setprecision(std::numeric_limits<double>::max_digits10);
 
     uint_t nfeature = model.featureMean.size();
     uint_t nbasis = model.modelWeights.size();
@@ -66,10 +77,30 @@ void write_model(const options_t& opts, const PHZ_GPz::GPzModel& model) {
     }
 }
 
-void write_output(const options_t& opts, const PHZ_GPz::GPz& gpz,
-    const vec1s& id, const PHZ_GPz::GPzOutput& out) {
+uint_t output_id_width(const id_column_t& id) {
+    return std::max(id.width+1, uint_t(7));
+}
+
+// With several outputs, columns are suffixed with the name of the output
+vec1s output_suffixes(const options_t& opts) {
+    if (opts.output_columns.size() > 1) {
+        return "_"+opts.output_columns;
+    } else {
+        return {""};
+    }
+}
+
+uint_t output_value_width(const options_t& opts) {
+    uint_t width = 15;
+    for (const std::string& s : output_suffixes(opts)) {
+        width = std::max(width, uint_t(14 + s.size())); // "var.tr.noise" + suffix + space
+    }
 
-    std::ofstream fout(opts.output_catalog);
+    return width;
+}
+
+void write_output_header(std::ostream& fout, const options_t& opts, const PHZ_GPz::GPz& gpz,
+    const id_column_t& id) {
 
     if (std::string(gpzpp_git_hash).empty()) {
         fout << "# GPz version: " << gpzpp_version << std::endl;
@@ -129,32 +160,64 @@ void write_output(const options_t& opts, const PHZ_GPz::GPz& gpz,
 
     fout << "#";
 
-    uint_t id_width = 7;
     if (!id.empty()) {
-        id_width = min(max(length(id))+1, id_width);
-        fout << align_right("id", id_width);
+        fout << align_right("id", output_id_width(id));
+    }
+
+    const output_quantities_t& q = opts.quantities;
+    uint_t value_width = output_value_width(opts);
+    for (const std::string& s : output_suffixes(opts)) {
+        if (q.value)           fout << align_right("value"+s, value_width);
+        if (q.uncertainty)     fout << align_right("uncertainty"+s, value_width);
+        if (q.var_density)     fout << align_right("var.density"+s, value_width);
+        if (q.var_train_noise) fout << align_right("var.tr.noise"+s, value_width);
+        if (q.var_input_noise) fout << align_right("var.in.noise"+s, value_width);
     }
 
-    uint_t value_width = 15;
-    fout << align_right("value", value_width);
-    fout << align_right("uncertainty", value_width);
-    fout << align_right("var.density", value_width);
-    fout << align_right("var.tr.noise", value_width);
-    fout << align_right("var.in.noise", value_width);
     fout << std::endl;
+}
+
+void write_output_rows(std::ostream& fout, const options_t& opts, const id_column_t& id,
+    const std::vector<PHZ_GPz::GPzOutput>& outs, uint_t first_row) {
 
-    uint_t nelem = out.value.size();
+    const output_quantities_t& q = opts.quantities;
+    uint_t id_width = output_id_width(id);
+    uint_t value_width = output_value_width(opts);
+
+    uint_t nelem = (outs.empty() ? 0 : outs[0].value.size());
     for (uint_t i : range(nelem)) {
         if (!id.empty()) {
-            fout << std::setw(id_width) << id[i];
+            id.write(fout, first_row + i, id_width);
         }
 
-        fout << std::setw(value_width) << std::scientific << out.value[i];
-        fout << std::setw(value_width) << std::scientific << out.uncertainty[i];
-        fout << std::setw(value_width) << std::scientific << out.varianceTrainDensity[i];
-        fout << std::setw(value_width) << std::scientific << out.varianceTrainNoise[i];
-        fout << std::setw(value_width) << std::scientific << out.varianceInputNoise[i];
+        for (const auto& out : outs) {
+            if (q.value) {
+                fout << std::setw(value_width) << std::scientific << out.value[i];
+            }
+            if (q.uncertainty) {
+                fout << std::setw(value_width) << std::scientific << out.uncertainty[i];
+            }
+            if (q.var_density) {
+                fout << std::setw(value_width) << std::scientific << out.varianceTrainDensity[i];
+            }
+            if (q.var_train_noise) {
+                fout << std::setw(value_width) << std::scientific << out.varianceTrainNoise[i];
+            }
+            if (q.var_input_noise) {
+                fout << std::setw(value_width) << std::scientific << out.varianceInputNoise[i];
+            }
+        }
 
         fout << "\n";
     }
 }
+
+void write_output(const options_t& opts, const PHZ_GPz::GPz& gpz,
+    const id_column_t& id, const PHZ_GPz::GPzOutput& out) {
+
+    compression_t compression;
+    parse_compression(opts.output_compression, compression);
+    output_file_t fout(opts.output_catalog, compression);
+    write_output_header(fout, opts, gpz, id);
+    write_output_rows(fout, opts, id, {out}, 0);
+}
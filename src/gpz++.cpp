@@ -1,73 +1,281 @@
 #include "gpz++.hpp"
 #include <vif/core/main.hpp>
 
-#ifndef GPZPP_GIT_HASH
-#define GPZPP_GIT_HASH ""
-#endif
-
-const char* gpzpp_version = "1.0.0";
-const char* gpzpp_git_hash = GPZPP_GIT_HASH;
-
 int vif_main(int argc, char* argv[]) {
     std::string param_file = (argc >= 2 ? argv[1] : "gpz.param");
 
     // Setup
     options_t opts;
     PHZ_GPz::GPz gpz;
+    uint_t pid = profile_start("read_config");
     if (!read_config(param_file, opts, gpz)) {
         return 1;
     }
 
-    bool no_model = true;
-    if (file::exists(opts.model_file)) {
-        no_model = false;
+    profile_stop(pid);
+
+    // One model per output, all sharing the same GPz options
+    const uint_t nout = opts.output_columns.size();
+    std::vector<options_t> oopts(nout);
+    for (uint_t i : range(nout)) {
+        oopts[i] = output_options(opts, i);
     }
 
-    if (!opts.reuse_model || no_model) {
-        // Train
+    std::vector<PHZ_GPz::GPz> models(nout, gpz);
+
+    std::ofstream feval;
+    if (!opts.evaluate_catalog.empty() || opts.evaluate_validation) {
+        feval.open(opts.evaluate_file);
+        if (!feval) {
+            error("could not open evaluation file '", opts.evaluate_file, "' for writing");
+            return 1;
+        }
+
+        feval << "# GPz++ " << gpzpp_version << " evaluation\n\n";
+    }
+
+    // Sample name in the evaluation file
+    auto sample_name = [&](const std::string& sample, uint_t i) {
+        return (nout == 1 ? sample : sample+", output '"+opts.output_columns[i]+"'");
+    };
+
+    // Find which model to use for each output
+    std::vector<PHZ_GPz::GPzModel> hint(nout);
+    vec1s model_file(nout);
+    vec1b train(nout), cached(nout);
+    for (uint_t i : range(nout)) {
+        const options_t& o = oopts[i];
+        bool no_model = true;
+        if (file::exists(o.model_file)) {
+            no_model = false;
+        }
 
         // Read existing model if asked
-        PHZ_GPz::GPzModel model;
         if (!no_model && opts.use_model_as_hint) {
-            if (!read_model(opts, model)) {
+            if (!read_model(o.model_file, opts, hint[i])) {
                 return 1;
             }
         }
 
-        // Read data
+        model_file[i] = o.model_file;
+        train[i] = !opts.reuse_model || no_model;
+        if (!opts.model_cache_dir.empty() && !opts.training_catalog.empty()) {
+            model_file[i] = model_cache_file(o, hint[i]);
+            cached[i] = file::exists(model_file[i]);
+            train[i] = !opts.reuse_model || !cached[i];
+
+            if (opts.verbose) {
+                if (!train[i]) {
+                    note("reusing cached model '", model_file[i], "'");
+                } else if (!cached[i]) {
+                    note("no cached model for this training set and options, training a new model",
+                        nout > 1 ? " for '"+o.output_column+"'" : "");
+                }
+            }
+        }
+    }
+
+    // Specialist models are retrained with the global models, or if they cannot be reused
+    specialist_set_t specialists;
+    bool train_spec = opts.specialist_models && (count(train) != 0 || !opts.reuse_model ||
+        !file::exists(specialist_list_file(opts)));
+
+    if (train_spec && opts.training_catalog.empty()) {
+        error("specialist models must be trained, but no training catalog was provided");
+        note("please specify TRAINING_CATALOG=..., or provide the list of specialist models '",
+            specialist_list_file(opts), "'");
+        return 1;
+    }
+
+    if (count(train) != 0 || train_spec) {
+        // Train
+
+        // Read data (once for all outputs)
         PHZ_GPz::Vec2d input, input_error;
-        PHZ_GPz::Vec1d output, output_weight;
+        PHZ_GPz::Vec2d output;
+        PHZ_GPz::Vec1d output_weight;
         if (!read_training(opts, input, input_error, output, output_weight)) {
             return 1;
         }
 
+        for (uint_t i : range(nout)) {
+            oopts[i].bands = opts.bands;
+        }
+
+        if (opts.n_thread_auto) {
+            // Measure how the fit scales with the number of threads
+            pid = profile_start("calibrate_threads");
+            calibrate_threads(opts, gpz, input, input_error, output.col(0), output_weight);
+            profile_stop(pid);
+
+            for (uint_t i : range(nout)) {
+                oopts[i].threads = opts.threads;
+            }
+        }
+
         // Do training
+        pid = profile_start("fit");
         try {
-            gpz.fit(input, input_error, output, output_weight, model);
+            if (!train_models(oopts, models, train, input, input_error, output, output_weight, hint)) {
+                return 1;
+            }
         } catch (std::exception& e) {
             error("an exception occured during the training");
             error(e.what());
             return 1;
         }
 
-        if (opts.save_model) {
-            // Write model
-            write_model(opts, gpz.getModel());
+        profile_stop(pid, input.rows()*count(train));
+
+        for (uint_t i : where(train)) {
+            const options_t& o = oopts[i];
+            PHZ_GPz::GPz& gpz = models[i];
+
+            if (opts.evaluate_validation) {
+                // Evaluate on the validation set
+                PHZ_GPz::Vec1d ioutput = output.col(i);
+                vec1u train_rows, valid_rows;
+                split_training(o, ioutput.size(), train_rows, valid_rows);
+                if (valid_rows.empty()) {
+                    warning("the validation set is empty (TRAIN_VALID_RATIO=1), cannot evaluate it");
+                } else if (!check_split(gpz, input, train_rows)) {
+                    warning("could not check that the validation set of '", o.output_column,
+                        "' is the one used by the GPz library (this requires "
+                        "NORMALIZATION_SCHEME=whiten), cannot evaluate it");
+                } else {
+                    pid = profile_start("evaluate_validation");
+                    try {
+                        // The specialists were trained on their own split, evaluate the global
+                        // model alone
+                        specialist_set_t none;
+                        if (!evaluate_predictions(o, gpz, none, i, extract_rows(input, valid_rows),
+                            extract_rows(input_error, valid_rows), extract_rows(ioutput, valid_rows),
+                            sample_name("validation", i), feval)) {
+                            return 1;
+                        }
+                    } catch (std::exception& e) {
+                        error("an exception occured while evaluating the validation set");
+                        error(e.what());
+                        return 1;
+                    }
+
+                    profile_stop(pid, valid_rows.size());
+                }
+            }
+
+            if (opts.save_model || model_file[i] != o.model_file) {
+                // Write model
+                pid = profile_start("write_model");
+                if (opts.save_model) {
+                    write_model(o, gpz.getModel());
+                }
+
+                if (model_file[i] != o.model_file) {
+                    // Write to a temporary file first, so an interrupted run cannot leave a
+                    // truncated model in the cache
+                    if (!file::mkdir(opts.model_cache_dir)) {
+                        warning("could not create model cache directory '", opts.model_cache_dir, "'");
+                    } else {
+                        write_model(model_file[i]+".tmp", o, gpz.getModel());
+                        if (std::rename((model_file[i]+".tmp").c_str(), model_file[i].c_str()) != 0) {
+                            warning("could not save model in cache as '", model_file[i], "'");
+                        }
+                    }
+                }
+
+                profile_stop(pid);
+            }
+        }
+
+        if (train_spec) {
+            // Train specialist models
+            pid = profile_start("fit_specialists");
+            try {
+                if (!train_specialists(opts, gpz, input, input_error, output, output_weight,
+                    specialists)) {
+                    return 1;
+                }
+            } catch (std::exception& e) {
+                error("an exception occured during the training of the specialist models");
+                error(e.what());
+                return 1;
+            }
+
+            profile_stop(pid, input.rows()*nout);
+
+            if (opts.save_model || !opts.model_cache_dir.empty()) {
+                pid = profile_start("write_model");
+                if (!write_specialists(opts, specialists)) {
+                    return 1;
+                }
+
+                if (opts.save_model && !opts.model_cache_dir.empty()) {
+                    // Also save them next to MODEL_FILE, like the global models
+                    options_t o = opts;
+                    o.model_cache_dir = "";
+                    if (!write_specialists(o, specialists)) {
+                        return 1;
+                    }
+                }
+
+                profile_stop(pid);
+            }
         }
-    } else {
+    }
+
+    for (uint_t i : where(!train)) {
         // Load existing model
+        pid = profile_start("load_model");
         PHZ_GPz::GPzModel model;
-        if (!read_model(opts, model)) {
+        if (!read_model(model_file[i], opts, model)) {
             return 1;
         }
 
         try {
-            gpz.loadModel(model);
+            models[i].loadModel(model);
         } catch (std::exception& e) {
             error("an exception occured while loading the model");
             error(e.what());
             return 1;
         }
+
+        if (cached[i] && opts.save_model) {
+            // Keep MODEL_FILE in sync with the model actually used
+            oopts[i].bands = opts.bands;
+            write_model(oopts[i], model);
+        }
+
+        profile_stop(pid);
+
+        if (opts.evaluate_validation) {
+            warning("the model", nout > 1 ? " for '"+oopts[i].output_column+"'" : "",
+                " was not trained in this run, cannot evaluate the validation set");
+        }
+    }
+
+    if (opts.specialist_models && !train_spec) {
+        // Load existing specialist models
+        pid = profile_start("load_model");
+        try {
+            if (!read_specialists(opts, gpz, specialists)) {
+                return 1;
+            }
+        } catch (std::exception& e) {
+            error("an exception occured while loading the specialist models");
+            error(e.what());
+            return 1;
+        }
+
+        if (opts.save_model && !opts.model_cache_dir.empty() && !opts.training_catalog.empty()) {
+            // Keep the specialists next to MODEL_FILE in sync with those actually used
+            options_t o = opts;
+            o.model_cache_dir = "";
+            if (!write_specialists(o, specialists)) {
+                return 1;
+            }
+        }
+
+        profile_stop(pid);
     }
 
     if (!opts.prediction_catalog.empty()) {
@@ -75,23 +283,63 @@ int vif_main(int argc, char* argv[]) {
 
         // Read data
         PHZ_GPz::Vec2d input, input_error;
-        vec1s id;
+        id_column_t id;
         if (!read_prediction(opts, id, input, input_error)) {
             return 1;
         }
 
-        // Do prediction
-        PHZ_GPz::GPzOutput out;
+        // Do prediction of all outputs and write output to disk
         try {
-            out = gpz.predict(input, input_error);
+            if (!predict_catalog(opts, models, specialists, id, input, input_error)) {
+                return 1;
+            }
         } catch (std::exception& e) {
             error("an exception occured while making predictions");
             error(e.what());
             return 1;
         }
+    }
+
+    if (!opts.evaluate_catalog.empty()) {
+        // Evaluate
 
-        // Write output to disk
-        write_output(opts, gpz, id, out);
+        // Read data in blocks (once for all outputs), do prediction and accumulate metrics
+        std::vector<evaluation_t> evals(nout);
+        pid = profile_start("evaluate");
+        try {
+            bool read = read_evaluation(opts, evaluation_block_size(opts),
+                [&](const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& input_error,
+                const PHZ_GPz::Vec2d& output) {
+
+                profile_resume(pid);
+                for (uint_t i : range(nout)) {
+                    evals[i].add(oopts[i], models[i], specialists, i, input, input_error,
+                        output.col(i));
+                }
+
+                profile_stop(pid, input.rows());
+                return true;
+            });
+
+            if (!read) {
+                return 1;
+            }
+        } catch (std::exception& e) {
+            error("an exception occured while evaluating the predictions");
+            error(e.what());
+            return 1;
+        }
+
+        for (uint_t i : range(nout)) {
+            if (!evals[i].write(oopts[i], sample_name("catalog '"+opts.evaluate_catalog+"'", i),
+                feval)) {
+                return 1;
+            }
+        }
+    }
+
+    if (!write_profile(opts, models[0])) {
+        return 1;
     }
 
     return 0;
@@ -12,6 +12,12 @@
 #include <vif/astro/astro.hpp>
 #include <vif/io/ascii.hpp>
 #include <iomanip>
+#include <cstdint>
+#include <set>
+#include <map>
+#include <memory>
+#include <functional>
+#include <fstream>
 #include <PHZ_GPz/GPz.h>
 
 using namespace vif;
@@ -20,6 +26,33 @@ using namespace vif::astro;
 extern const char* gpzpp_version;
 extern const char* gpzpp_git_hash;
 
+// Quantities written for each prediction, see OUTPUT_COLUMNS
+struct output_quantities_t {
+    bool value = true;
+    bool uncertainty = true;
+    bool var_density = true;
+    bool var_train_noise = true;
+    bool var_input_noise = true;
+
+    // Variance components needed to compute the selected quantities
+    bool need_density() const     { return uncertainty || var_density; }
+    bool need_train_noise() const { return uncertainty || var_train_noise; }
+    bool need_input_noise() const { return uncertainty || var_input_noise; }
+    bool need_variance() const {
+        return need_density() || need_train_noise() || need_input_noise();
+    }
+    bool need_all() const {
+        return need_density() && need_train_noise() && need_input_noise();
+    }
+};
+
+// CPUs available to GPz++ and calibration of the fits, see N_THREAD=auto
+struct thread_setup_t {
+    std::vector<vec1u> numa_cpus; // usable CPUs in each NUMA node
+    vec1u calib_threads;          // threads given to one fit in the calibration
+    vec1d calib_time;             // time taken by the calibration fit, for each
+};
+
 struct options_t {
     std::string training_catalog;
     std::string prediction_catalog;
@@ -30,7 +63,8 @@ struct options_t {
     bool reuse_model = true;
     bool use_model_as_hint = false;
 
-    std::string output_column = "z_spec";
+    std::string output_column = "z_spec"; // current output
+    vec1s       output_columns;           // all outputs (OUTPUT_COLUMN can be a list)
     std::string weight_column = "";
     std::string flux_column_prefix = "F";
     std::string error_column_prefix = "E";
@@ -38,27 +72,517 @@ struct options_t {
     vec1s       bands_regex;
     double      output_min = -finf;
     double      output_max = +finf;
+    vec1d       output_min_list;  // OUTPUT_MIN, one value for all outputs or one per output
+    vec1d       output_max_list;  // OUTPUT_MAX, idem
     std::string transform_inputs = "";
+    vec1d       luptitude_f0;     // LUPTITUDE_F0, one value for all features or one per feature
+    uint_t      train_max_rows = 0;
+    uint_t      train_max_rows_per_bin = 0;
+    uint_t      train_sample_seed = 42;
+    std::string row_filter = "";
+    vec1u       row_range;
+    bool        catalog_index = false;
+    uint_t      index_stride = 10000;
+    bool        training_cache = false;
+
+    bool   specialist_models = false;
+    uint_t specialist_min_rows = 1000;
+    uint_t specialist_num_bf = 0;
+
+    bool   approx_prediction = false;
+    double approx_tolerance = 1e-4;
+    uint_t approx_check_sample = 1000;
+
+    vec1s               output_quantities; // OUTPUT_COLUMNS, empty for all
+    output_quantities_t quantities;
+
+    std::string pdf_file = "";
+    std::string pdf_format = "float32";
+    double      pdf_grid_min = 0.0;
+    double      pdf_grid_max = 7.0;
+    double      pdf_grid_step = 0.01;
+
+    uint_t prediction_block_size = 0;
+    bool   resume_prediction = false;
+
+    std::string model_cache_dir = "";
+    std::string output_compression = "none";
+    std::string prediction_cache = "";
+
+    std::string evaluate_catalog = "";
+    bool        evaluate_validation = false;
+    std::string evaluate_file = "gpz_eval.txt";
+    double      evaluate_bin = 0.0;
+    double      evaluate_outlier = 0.15;
+    bool        evaluate_relative = true; // current output
+    vec1u       evaluate_relative_list;   // EVALUATE_RELATIVE, one value for all outputs or one per output
+
+    std::string profile_file = "";
+
+    // GPz options, given to GPz at the end of read_config(). Those that GPz can report are
+    // initialized from the defaults of GPz. The others are only given to GPz if they are set in
+    // the parameter file (listed in gpz_options_set), otherwise GPz keeps its own default; the
+    // values below are then only used by GPz++ itself (training sample, validation split).
+    bool   verbose = true;
+    uint_t n_thread = 0;
+    bool   n_thread_auto = false;
+    thread_setup_t threads;
+    bool   predict_error = true;
+    uint_t num_bf = 100;
+    PHZ_GPz::CovarianceType covariance = PHZ_GPz::CovarianceType::VARIABLE_DIAGONAL;
+    PHZ_GPz::PriorMeanFunction prior_mean = PHZ_GPz::PriorMeanFunction::CONSTANT_PREPROCESS;
+    PHZ_GPz::WeightingScheme weighting_scheme = PHZ_GPz::WeightingScheme::UNIFORM;
+    PHZ_GPz::NormalizationScheme normalization_scheme = PHZ_GPz::NormalizationScheme::WHITEN;
+    PHZ_GPz::OutputUncertaintyType output_error_type =
+        PHZ_GPz::OutputUncertaintyType::INPUT_DEPENDENT;
+    double balanced_weighting_bin = 0.1;
+    double balanced_weighting_max_weight = 10.0;
+    uint_t bf_position_seed = 55;
+    bool   fuzzing = false;
+    uint_t fuzzing_seed = 97;
+    uint_t max_iter = 500;
+    double tolerance = 1e-9;
+    double grad_tolerance = 1e-5;
+    double train_valid_ratio = 0.5;
+    uint_t valid_sample_seed = 42;
+    PHZ_GPz::TrainValidationSplitMethod valid_sample_method =
+        PHZ_GPz::TrainValidationSplitMethod::RANDOM;
+    std::set<std::string> gpz_options_set;
+
+    bool gpz_option_set(const std::string& name) const {
+        return gpz_options_set.find(name) != gpz_options_set.end();
+    }
 
     vec1s bands;
 };
 
+// Object IDs, stored without one string per object. Integer IDs are stored as such, other IDs
+// are concatenated in a single string buffer.
+struct id_column_t {
+    bool is_integer = true;
+    std::vector<std::int64_t> ivalue;
+    std::string arena;
+    std::vector<uint_t> offset = {0}; // start of each ID in arena, plus end of last ID
+    uint_t width = 0; // longest ID
+
+    uint_t size() const;
+    bool empty() const;
+    void clear();
+    void reserve(uint_t n);
+    void push_back(const std::string& str);
+    std::string operator[](uint_t i) const;
+    void write(std::ostream& out, uint_t i, uint_t w) const;
+
+private:
+    void convert_to_string();
+};
+
+// Row selection expression, evaluated on the raw catalog columns
+struct row_filter_t {
+    enum class op_t {
+        constant, column, neg, lnot, abs, isnan, isfinite,
+        add, sub, mul, div, lt, le, gt, ge, eq, ne, land, lor
+    };
+
+    struct node_t {
+        op_t op = op_t::constant;
+        double value = 0.0;
+        uint_t column = npos; // index in 'columns'
+        uint_t a = npos, b = npos; // operands
+    };
+
+    std::vector<node_t> nodes;
+    uint_t root = npos;
+    vec1u columns; // catalog columns used by the expression
+    vec1s names;   // ... and their names
+
+    bool empty() const;
+    bool compile(const std::string& expr, const vec1s& header);
+    bool evaluate(const vec1s& spl, bool& pass) const;
+
+private:
+    mutable vec1d values;
+    double evaluate_node(uint_t i) const;
+};
+
+// Sparse index of the rows of an ASCII catalog
+struct catalog_index_t {
+    std::uint64_t signature = 0;
+    std::uint64_t header_offset = 0;
+    vec1s header;
+    uint_t nrow = 0;
+    uint_t stride = 0;
+    std::vector<std::uint64_t> offset; // byte offset of data rows 0, stride, 2*stride, ...
+    std::vector<uint_t> line;          // line number of these rows (starting at 1)
+    std::map<std::string, double> f0;  // luptitude softening over all rows, per column and rule
+};
+
+bool get_catalog_index(const std::string& catalog, uint_t stride, bool verbose,
+    catalog_index_t& index);
+
+bool save_catalog_index(const std::string& catalog, const catalog_index_t& index);
+
+// Binary cache of the training arrays, see TRAINING_CACHE
+bool read_training_cache(options_t& opts, PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError,
+    PHZ_GPz::Vec2d& output, PHZ_GPz::Vec1d& weight);
+
+void write_training_cache(const options_t& opts, const PHZ_GPz::Vec2d& input,
+    const PHZ_GPz::Vec2d& inputError, const PHZ_GPz::Vec2d& output, const PHZ_GPz::Vec1d& weight);
+
+// Reproducible bounded-size sampling of the training rows, see TRAIN_MAX_ROWS
+struct row_sampler_t {
+    explicit row_sampler_t(const options_t& opts);
+
+    bool enabled() const;
+    uint_t add(uint_t row, double output); // storage slot for the row, or npos if rejected
+    vec1u kept_slots() const;              // slots of the sampled rows, in catalog order
+
+    uint_t nslot = 0; // number of storage slots in use
+
+private:
+    struct entry_t {
+        std::uint64_t key = 0;
+        uint_t row = 0, slot = 0;
+
+        bool operator<(const entry_t& o) const {
+            return key < o.key || (key == o.key && row < o.row);
+        }
+    };
+
+    void remove(entry_t e);
+
+    uint_t max_rows = 0, max_per_bin = 0;
+    double bin_size = 0.0;
+    std::uint64_t seed = 0;
+
+    std::set<entry_t> kept;
+    std::map<std::int64_t, std::set<entry_t>> bins;
+    std::vector<std::int64_t> slot_bin;
+    std::vector<uint_t> free_slots;
+};
+
+// Compressed files
+enum class compression_t {
+    none, gzip, zstd
+};
+
+bool parse_compression(const std::string& name, compression_t& c);
+std::string compression_name(compression_t c);
+bool compression_supported(compression_t c);
+compression_t detect_compression(const std::string& filename);
+
+// Input file, decompressed on the fly by a background thread if needed
+struct input_file_t : std::istream {
+    explicit input_file_t(const std::string& filename);
+    ~input_file_t();
+
+    bool is_open() const;
+    bool compressed() const;
+    bool check() const; // report open or decompression errors
+
+private:
+    std::string filename;
+    compression_t compression = compression_t::none;
+    std::unique_ptr<std::streambuf> buffer;
+};
+
+// Output file, compressed on the fly if needed
+struct output_file_t : std::ostream {
+    output_file_t(const std::string& filename, compression_t compression, bool append = false);
+    ~output_file_t();
+
+    bool end_block();           // end the compressed frame and flush it to disk
+    std::uint64_t size() const; // bytes written to disk so far, including previous content
+
+private:
+    std::unique_ptr<std::streambuf> buffer;
+};
+
 // Read inputs
 bool read_config(const std::string& filename, options_t& opts, PHZ_GPz::GPz& gpz);
 
+options_t output_options(const options_t& opts, uint_t i);
+
 bool read_model(options_t& opts, PHZ_GPz::GPzModel& model);
 
+bool read_model(const std::string& filename, options_t& opts, PHZ_GPz::GPzModel& model);
+
 bool read_training(options_t& opts,
     PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError,
     PHZ_GPz::Vec1d& output, PHZ_GPz::Vec1d& weight);
 
+bool read_training(options_t& opts,
+    PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError,
+    PHZ_GPz::Vec2d& output, PHZ_GPz::Vec1d& weight);
+
+// Called with each block of rows of a catalog read in blocks (inputs after TRANSFORM_INPUTS,
+// and one column per output); return false to stop reading
+using row_block_t = std::function<bool(const PHZ_GPz::Vec2d& input,
+    const PHZ_GPz::Vec2d& inputError, const PHZ_GPz::Vec2d& output)>;
+
+// Read EVALUATE_CATALOG in blocks of 'block_size' rows, without keeping the whole catalog in
+// memory
+bool read_evaluation(options_t& opts, uint_t block_size, const row_block_t& process);
+
 bool read_prediction(options_t& opts,
-    vec1s& id, PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError);
+    id_column_t& id, PHZ_GPz::Vec2d& input, PHZ_GPz::Vec2d& inputError);
+
+// Hashing
+const std::uint64_t hash_seed = 14695981039346656037ull;
+
+std::uint64_t hash_bytes(const void* data, std::size_t size, std::uint64_t seed = hash_seed);
+std::uint64_t hash_string(const std::string& str, std::uint64_t seed = hash_seed);
+std::uint64_t hash_model(const PHZ_GPz::GPzModel& model, std::uint64_t seed = hash_seed);
+std::uint64_t file_signature(const std::string& filename, std::uint64_t seed = hash_seed);
+std::string hash_hex(std::uint64_t h);
+
+// Model cache
+std::uint64_t training_data_key(const options_t& opts);
+
+std::string model_cache_file(const options_t& opts, const PHZ_GPz::GPzModel& hint);
+
+std::string specialist_cache_file(const options_t& opts);
+
+// Profiling (main thread only)
+uint_t profile_start(const std::string& name);
+void profile_resume(uint_t id);
+void profile_stop(uint_t id, uint_t nrow = 0);
+double profile_last(const std::string& name);
+bool write_profile(const options_t& opts, const PHZ_GPz::GPz& gpz);
+
+// Train
+bool train_models(const std::vector<options_t>& opts, std::vector<PHZ_GPz::GPz>& gpz,
+    const vec1b& train, const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec2d& output, const PHZ_GPz::Vec1d& weight,
+    const std::vector<PHZ_GPz::GPzModel>& hint);
+
+void split_training(const options_t& opts, uint_t nrow, vec1u& train, vec1u& valid);
+bool check_split(const PHZ_GPz::GPz& gpz, const PHZ_GPz::Vec2d& input, const vec1u& train);
+
+void set_fit_threads(PHZ_GPz::GPz& gpz, uint_t nthread);
+
+// Run 'job(k)' for k in [0,njob) on 'nworker' threads. If 'start' is set, all the workers are
+// new threads and call 'start(w)' first, with w their index; otherwise the calling thread is
+// one of the workers.
+void run_concurrently(uint_t njob, uint_t nworker, const std::function<void(uint_t)>& job,
+    const std::function<void(uint_t)>& start = nullptr);
+
+// Split of the threads between concurrent fits
+struct thread_plan_t {
+    uint_t nfit = 1;        // fits running at the same time
+    uint_t nthread_fit = 1; // threads used internally by each fit
+    bool   pin = false;     // pin the fits to NUMA nodes (see pin_thread())
+};
+
+void detect_threads(options_t& opts);
+
+void calibrate_threads(options_t& opts, const PHZ_GPz::GPz& base,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec1d& output, const PHZ_GPz::Vec1d& weight);
+
+thread_plan_t plan_fits(const options_t& opts, uint_t njob);
+
+// Pin the calling thread, worker 'worker' of 'nworker', to one of the NUMA nodes
+bool pin_thread(const options_t& opts, uint_t worker, uint_t nworker);
+
+// Specialist models for frequent patterns of missing features, see SPECIALIST_MODELS
+struct specialist_set_t {
+    vec1s patterns;                // one character per feature: '1' observed, '0' missing
+    std::vector<vec1u> features;   // indices of the observed features, for each pattern
+    vec1u ntrain;                  // number of training rows, for each pattern
+    std::vector<std::vector<PHZ_GPz::GPz>> gpz; // one model per pattern and per output
+
+    bool empty() const;
+    void add(const std::string& pattern, uint_t nrow, uint_t nout, const PHZ_GPz::GPz& base);
+
+    // Group rows by model: groups[0] for the global model, groups[1+s] for pattern s
+    std::vector<vec1u> route(const PHZ_GPz::Vec2d& input) const;
+
+private:
+    std::map<std::string, uint_t> lookup;
+};
+
+std::string missing_pattern(const PHZ_GPz::Vec2d& input, uint_t row);
+
+std::string specialist_list_file(const options_t& opts);
+
+bool train_specialists(const options_t& opts, const PHZ_GPz::GPz& base,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec2d& output, const PHZ_GPz::Vec1d& weight, specialist_set_t& spec);
+
+bool read_specialists(const options_t& opts, const PHZ_GPz::GPz& base, specialist_set_t& spec);
+
+bool write_specialists(const options_t& opts, const specialist_set_t& spec);
+
+// Predict
+PHZ_GPz::Vec2d extract_rows(const PHZ_GPz::Vec2d& data, const vec1u& rows);
+
+PHZ_GPz::Vec2d extract_rows(const PHZ_GPz::Vec2d& data, const vec1u& rows, const vec1u& cols);
+
+PHZ_GPz::Vec1d extract_rows(const PHZ_GPz::Vec1d& data, const vec1u& rows);
+
+void copy_output_rows(const PHZ_GPz::GPzOutput& from, const vec1u& rows,
+    uint_t nrow, PHZ_GPz::GPzOutput& to);
+
+// State of the predictions of a whole catalog, kept across blocks of rows: the work that only
+// needs doing once per model (e.g., the accuracy check of APPROX_PREDICTION) is done on first
+// use, and its results are reported once by report()
+struct prediction_context_t {
+    struct model_state_t;
+
+    prediction_context_t();
+    ~prediction_context_t();
+
+    model_state_t& state(const PHZ_GPz::GPz& gpz, const std::string& label = "");
+    void report(const options_t& opts) const;
+
+private:
+    std::map<const PHZ_GPz::GPz*, std::unique_ptr<model_state_t>> states;
+    std::vector<const model_state_t*> order; // order of first use
+};
+
+void make_predictions(const options_t& opts, PHZ_GPz::GPz& gpz,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out,
+    prediction_context_t& ctx);
+
+// Predict output 'iout' with the specialist models for the rows routed to them, and with
+// the global model for the others (see specialist_set_t::route())
+void make_predictions(const options_t& opts, PHZ_GPz::GPz& gpz, specialist_set_t& spec,
+    uint_t iout, const std::vector<vec1u>& groups,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, PHZ_GPz::GPzOutput& out,
+    prediction_context_t& ctx);
+
+bool predict_catalog(const options_t& opts, std::vector<PHZ_GPz::GPz>& gpz,
+    specialist_set_t& spec, const id_column_t& id,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError);
+
+// Low-latency prediction of one object at a time, see gpz++-single.cpp
+struct single_predictor_t {
+    struct result_t {
+        double value = dnan;
+        double uncertainty = dnan;
+        double variance_train_density = dnan;
+        double variance_train_noise = dnan;
+        double variance_input_noise = dnan;
+    };
+
+    single_predictor_t(const options_t& opts, PHZ_GPz::GPz& gpz);
+
+    // Predict one object from its features and their uncertainties (after TRANSFORM_INPUTS),
+    // given as arrays of getNumberOfFeatures() values; 'err' can be null. This does not
+    // allocate memory, unless the object has to be given to GPz::predict (see 'fast').
+    void predict_one(const double* flux, const double* err, result_t& result);
+
+    // Check if predict_one() would use the direct evaluation for this object
+    bool direct(const double* flux, const double* err);
+
+    bool fast = false;         // direct evaluation validated, for objects without uncertainties
+    bool fast_noisy = false;   // ... and with input uncertainties
+    bool fast_missing = false; // ... and with missing features
+    output_quantities_t quantities; // variance components computed by the direct evaluation
+
+private:
+    bool check(const PHZ_GPz::Vec2d& probes, const PHZ_GPz::Vec2d& errors);
+    void predict_noisy(result_t& result);
+    void predict_gpz(const double* flux, const double* err, result_t& result);
+
+    PHZ_GPz::GPz& gpz;
+    bool predict_error = true;
+    bool uniform_noise = false;
+    bool diagonal = false;
+    uint_t nbf = 0, nfeat = 0;
+    double output_mean = 0.0, log_noise = 0.0;
+
+    // Model factors
+    PHZ_GPz::Vec1d mean, inv_sigma, weights, noise_weights;
+    PHZ_GPz::Vec2d positions;      // nfeat x nbf
+    PHZ_GPz::Vec2d diag_precision; // nfeat x nbf
+    std::vector<PHZ_GPz::Vec2d> precision;
+    PHZ_GPz::Vec2d weight_covariance;
+
+    // Work space
+    PHZ_GPz::Vec1d x, psi, dx, y, phi, tmp;
+    std::vector<bool> observed;
+    bool noisy = false;
+    PHZ_GPz::Vec2d in1, err1;
+};
+
+// Persistent cache of predictions, see PREDICTION_CACHE
+struct prediction_cache_t {
+    bool init(const options_t& opts, const std::vector<PHZ_GPz::GPz>& gpz,
+        const specialist_set_t& spec, uint_t nfeature, bool with_errors);
+
+    // Fill 'out' with the cached predictions, and return the rows that were not found
+    vec1u lookup(const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+        std::vector<PHZ_GPz::GPzOutput>& out);
+
+    // Store the predictions of these rows
+    void insert(const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+        const vec1u& rows, const std::vector<PHZ_GPz::GPzOutput>& out);
+
+    bool enabled = false;
+    uint_t nlookup = 0, nhit = 0;
+
+private:
+    void row_bytes(const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError, uint_t i,
+        std::vector<double>& buffer) const;
+
+    std::string filename;
+    std::uint64_t context = 0;
+    uint_t nfeature = 0, noutput = 0;
+    bool has_error = false;
+    std::size_t slot_size = 0;
+};
+
+// Evaluate
+
+// Metrics of the predictions of one output on labelled data, accumulated block by block
+struct evaluation_t {
+    struct state_t;
+
+    evaluation_t();
+    evaluation_t(evaluation_t&&) noexcept;
+    ~evaluation_t();
+
+    // Predict these rows and add them to the metrics
+    void add(const options_t& opts, PHZ_GPz::GPz& gpz, specialist_set_t& spec, uint_t iout,
+        const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+        const PHZ_GPz::Vec1d& output);
+
+    // Write the metrics of all the rows added so far
+    bool write(const options_t& opts, const std::string& sample, std::ofstream& fout) const;
+
+private:
+    std::unique_ptr<state_t> state;
+};
+
+// Evaluate rows held in memory, in blocks of PREDICTION_BLOCK_SIZE
+bool evaluate_predictions(const options_t& opts, PHZ_GPz::GPz& gpz,
+    specialist_set_t& spec, uint_t iout,
+    const PHZ_GPz::Vec2d& input, const PHZ_GPz::Vec2d& inputError,
+    const PHZ_GPz::Vec1d& output, const std::string& sample, std::ofstream& fout);
+
+uint_t evaluation_block_size(const options_t& opts);
 
 // Write outputs
 void write_model(const options_t& opts, const PHZ_GPz::GPzModel& model);
 
+void write_model(const std::string& filename, const options_t& opts,
+    const PHZ_GPz::GPzModel& model);
+
+void write_output_header(std::ostream& fout, const options_t& opts, const PHZ_GPz::GPz& gpz,
+    const id_column_t& id);
+
+void write_output_rows(std::ostream& fout, const options_t& opts, const id_column_t& id,
+    const std::vector<PHZ_GPz::GPzOutput>& out, uint_t first_row);
+
 void write_output(const options_t& opts, const PHZ_GPz::GPz& gpz,
-    const vec1s& id, const PHZ_GPz::GPzOutput& out);
+    const id_column_t& id, const PHZ_GPz::GPzOutput& out);
+
+uint_t pdf_grid_size(const options_t& opts);
+
+void write_pdf_header(std::ofstream& fout, const options_t& opts, uint_t nrow);
+
+void write_pdf_rows(std::ofstream& fout, const options_t& opts, const PHZ_GPz::GPzOutput& out);
 
 #endif